@@ -1,9 +1,9 @@
 // バッファキャッシュである。
 //
 // バッファキャッシュは、ディスクブロック内容のキャッシュされたコピーを保持する
-// buf構造体のリンクリストである。メモリ内にディスクブロックをキャッシュすることで
-// ディスク読み取りの回数を減らし、複数のプロセスが使用するディスクブロックの
-// 同期ポイントも提供する。
+// buf構造体を(dev, blockno)のハッシュ表で管理したものである。
+// メモリ内にディスクブロックをキャッシュすることでディスク読み取りの回数を減らし、
+// 複数のプロセスが使用するディスクブロックの同期ポイントも提供する。
 //
 // インターフェース:
 // * 特定のディスクブロックのバッファを取得するには、breadを呼び出す。
@@ -17,74 +17,320 @@
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "riscv.h"
+#include "proc.h"
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
+#include "stat.h"
+
+// ハッシュ表のバケット数である。衝突を減らすため素数にしている。
+#define NBUCKET 127
+
+// (dev, blockno)からバケットの番号を求める。
+#define BHASH(dev, blockno) (((dev) * 31 + (blockno)) % NBUCKET)
+
+// 1ページに入るバッファのデータの数である。
+// バッファはこの数ずつまとめて1ページのkalloc()で確保し、まとめて解放する。
+// BSIZEがPGSIZEと等しければ、バッファのデータはちょうど1ページになる。
+#define BPP (PGSIZE / BSIZE)
+#if PGSIZE % BSIZE != 0
+#error "BSIZE must divide PGSIZE"
+#endif
+
+// メモリ不足のときにbshrink()が一度に返すページ数の上限である。
+#define NSHRINK 8
+
+// バッファを(dev, blockno)のハッシュでバケットに分け、バケットごとのロックで守る。
+// キャッシュにヒットした場合はそのバケットのロックだけを取るので、
+// 異なるブロックへのアクセスは並行して進められる。
+struct bucket {
+  struct spinlock lock;
+  struct buf head;  // このバケットに属するバッファの双方向リストの番兵である。
+};
 
 struct {
+  // 置き換え、拡張、縮小を行うプロセスを1つに限るロックである。
+  // 同じブロックのバッファが2つ作られるのを防ぐ。
+  // このロックを保持したまま複数のバケットのロックを取ってよい。
   struct spinlock lock;
+  // バッファのヘッダである。buf[i*BPP]からのBPP個のデータはpage[i]に置く。
+  // ページを持たないヘッダはどのバケットにも属さない。
   struct buf buf[NBUF];
+  uchar *page[NBUF/BPP];
+  int nbuf;   // ページを持つバッファの数である。
+  int nwait;  // 空きバッファを待って眠っているプロセスの数である。
+  struct bucket bucket[NBUCKET];
 
-  // すべてのバッファのリンクリストである。
-  // 使用頻度順にソートされている。
-  // head.nextが最も最近使用されたバッファであり、head.prevが最も古いバッファである。
-  struct buf head;
+  // 統計情報である。
+  uint64 hits;
+  uint64 misses;
+  uint64 evictions;
 } bcache;
 
+// バッファbをバケットbkのリストの先頭に入れる。bkのロックを保持している必要がある。
+static void
+bucket_insert(struct bucket *bk, struct buf *b)
+{
+  b->next = bk->head.next;
+  b->prev = &bk->head;
+  bk->head.next->prev = b;
+  bk->head.next = b;
+}
+
+// バッファbをそのバケットのリストから外す。バケットのロックを保持している必要がある。
+static void
+bucket_remove(struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+}
+
+// バケットbkのリストからdev上のブロックblocknoのバッファを探す。
+// bkのロックを保持している必要がある。見つからなければ0を返す。
+static struct buf*
+bucket_find(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head.next; b != &bk->head; b = b->next)
+    if(b->dev == dev && b->blockno == blockno)
+      return b;
+  return 0;
+}
+
+// ページを1つ確保して、BPP個の空のバッファを追加する。
+// bcache.lockを保持している必要がある。
+// 上限に達しているかメモリが足りない場合は-1を返す。
+static int
+bgrow(void)
+{
+  struct buf *b;
+  struct bucket *bk;
+  uchar *mem;
+  int i, j;
+
+  for(i = 0; i < NBUF/BPP; i++)
+    if(bcache.page[i] == 0)
+      break;
+  if(i == NBUF/BPP || (mem = kalloc()) == 0)
+    return -1;
+  bcache.page[i] = mem;
+
+  // 空のバッファはブロック0のものとして入れておく。valid == 0なので読まれることはない。
+  bk = &bcache.bucket[BHASH(0, 0)];
+  acquire(&bk->lock);
+  for(j = 0; j < BPP; j++){
+    b = &bcache.buf[i*BPP + j];
+    b->data = mem + j*BSIZE;
+    b->dev = 0;
+    b->blockno = 0;
+    b->valid = 0;
+    b->refcnt = 0;
+    b->lastuse = 0;
+    bucket_insert(bk, b);
+  }
+  release(&bk->lock);
+  bcache.nbuf += BPP;
+  return 0;
+}
+
 // バッファキャッシュを初期化する関数である。
 void
 binit(void)
 {
   struct buf *b;
+  struct bucket *bk;
 
   initlock(&bcache.lock, "bcache");
-
-  // バッファのリンクリストを作成する。
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++){
+    initlock(&bk->lock, "bcache.bucket");
+    bk->head.prev = &bk->head;
+    bk->head.next = &bk->head;
+  }
+  for(b = bcache.buf; b < bcache.buf+NBUF; b++)
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+
+  // ログの処理に必要な分だけ最初に確保し、残りは必要になったときに増やす。
+  acquire(&bcache.lock);
+  while(bcache.nbuf < NBUFMIN)
+    if(bgrow() < 0)
+      panic("binit");
+  release(&bcache.lock);
+}
+
+// 最も長く使われていない未使用のバッファを全バケットから探し、
+// バケットから外して返す。bcache.lockを保持している必要がある。
+// 未使用のバッファがなければ0を返す。
+static struct buf*
+bevict(void)
+{
+  struct buf *b, *victim;
+  struct bucket *vbk, *cur;
+
+  // 候補が見つかったバケットのロックだけを保持したまま探し続ける。
+  victim = 0;
+  vbk = 0;
+  for(cur = bcache.bucket; cur < bcache.bucket+NBUCKET; cur++){
+    int found = 0;
+    acquire(&cur->lock);
+    for(b = cur->head.next; b != &cur->head; b = b->next){
+      if(b->refcnt == 0 && (victim == 0 || b->lastuse < victim->lastuse)){
+        victim = b;
+        found = 1;
+      }
+    }
+    if(found){
+      if(vbk)
+        release(&vbk->lock);
+      vbk = cur;
+    } else {
+      release(&cur->lock);
+    }
+  }
+  if(victim){
+    bucket_remove(victim);
+    release(&vbk->lock);
   }
+  return victim;
 }
 
 // デバイスdev上のブロックをバッファキャッシュ内で検索する関数である。
 // 見つからなかった場合、バッファを割り当てる。
+// 上限まではページを確保してキャッシュを大きくし、それ以上は未使用のバッファを再利用する。
+// すべてのバッファが使用中であれば、brelse()で空くまで眠る。
 // いずれの場合も、ロックされたバッファを返す。
 static struct buf*
 bget(uint dev, uint blockno)
 {
   struct buf *b;
+  struct bucket *bk;
+  int grown;
 
-  acquire(&bcache.lock);
+  bk = &bcache.bucket[BHASH(dev, blockno)];
 
   // ブロックはすでにキャッシュされているか？
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
+  acquire(&bk->lock);
+  if((b = bucket_find(bk, dev, blockno)) != 0){
+    b->refcnt++;
+    release(&bk->lock);
+    __sync_fetch_and_add(&bcache.hits, 1);
+    acquiresleep(&b->lock);
+    return b;
+  }
+  release(&bk->lock);
+
+  acquire(&bcache.lock);
+  for(;;){
+    // 置き換えを1つに限ってから、その間に他のプロセスが
+    // 同じブロックを読み込んでいないか確かめ直す。
+    acquire(&bk->lock);
+    if((b = bucket_find(bk, dev, blockno)) != 0){
       b->refcnt++;
+      release(&bk->lock);
       release(&bcache.lock);
+      __sync_fetch_and_add(&bcache.hits, 1);
       acquiresleep(&b->lock);
       return b;
     }
+    release(&bk->lock);
+
+    // キャッシュされていない。上限まではキャッシュを大きくする。
+    // 追加した空のバッファはblocknoが0なので、下のbevict()で最初に選ばれる。
+    grown = (bcache.nbuf < NBUF && bgrow() == 0);
+
+    // brelse()が待っているプロセスに気づけるように、探す前に数を増やしておく。
+    bcache.nwait++;
+    b = bevict();
+    if(b == 0 && !grown)
+      sleep(&bcache, &bcache.lock);
+    bcache.nwait--;
+    if(b)
+      break;
   }
 
-  // キャッシュされていない。
-  // 最も最近使われていない未使用のバッファをリサイクルする。
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
+  if(b->valid)
+    bcache.evictions++;
+  bcache.misses++;
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->refcnt = 1;
+
+  acquire(&bk->lock);
+  bucket_insert(bk, b);
+  release(&bk->lock);
+  release(&bcache.lock);
+  acquiresleep(&b->lock);
+  return b;
+}
+
+// メモリが不足したときにkalloc_reclaim()から呼ばれ、キャッシュを縮小する。
+// バッファキャッシュのスピンロックを取るので、スピンロックを保持したまま呼んではならない。
+// BPP個のバッファがすべて未使用のページを、長く使われていないものから最大NSHRINK個返す。
+// NBUFMIN個のバッファは残す。返したページ数を返す。
+int
+bshrink(void)
+{
+  struct bucket *bk;
+  struct buf *b;
+  int i, j, best, n = 0;
+  uint bestuse, use;
+
+  acquire(&bcache.lock);
+  // ページ内のバッファは異なるバケットにあるので、すべてのバケットをロックする。
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++)
+    acquire(&bk->lock);
+
+  while(n < NSHRINK && bcache.nbuf - BPP >= NBUFMIN){
+    best = -1;
+    bestuse = 0;
+    for(i = 0; i < NBUF/BPP; i++){
+      if(bcache.page[i] == 0)
+        continue;
+      use = 0;
+      for(j = 0; j < BPP; j++){
+        b = &bcache.buf[i*BPP + j];
+        if(b->refcnt != 0)
+          break;
+        if(b->lastuse > use)
+          use = b->lastuse;
+      }
+      if(j == BPP && (best < 0 || use < bestuse)){
+        best = i;
+        bestuse = use;
+      }
+    }
+    if(best < 0)
+      break;
+    for(j = 0; j < BPP; j++){
+      b = &bcache.buf[best*BPP + j];
+      bucket_remove(b);
+      b->data = 0;
       b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
     }
+    kfree(bcache.page[best]);
+    bcache.page[best] = 0;
+    bcache.nbuf -= BPP;
+    n++;
   }
-  panic("bget: no buffers");
+
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++)
+    release(&bk->lock);
+  release(&bcache.lock);
+  return n;
+}
+
+// バッファキャッシュの統計情報をstに書き込む関数である。
+void
+bstat(struct bcachestat *st)
+{
+  acquire(&bcache.lock);
+  st->hits = bcache.hits;
+  st->misses = bcache.misses;
+  st->evictions = bcache.evictions;
+  st->nbuf = bcache.nbuf;
+  st->maxbuf = NBUF;
+  release(&bcache.lock);
 }
 
 // 指定されたブロックの内容を持つロックされたバッファを返す関数である。
@@ -101,6 +347,18 @@ bread(uint dev, uint blockno)
   return b;
 }
 
+// ディスクから読まずに、指定されたブロックのロックされたバッファを返す関数である。
+// 新しく割り当てたブロックのように、呼び出し元が内容をすべて書き込む場合に使う。
+struct buf*
+bnew(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno);
+  b->valid = 1;
+  return b;
+}
+
 // バッファの内容をディスクに書き込む関数である。ロックされている必要がある。
 void
 bwrite(struct buf *b)
@@ -110,8 +368,57 @@ bwrite(struct buf *b)
   virtio_disk_rw(b, 1);
 }
 
+// n個のロックされたバッファbs[]をまとめてディスクに書き込む関数である。
+// ディスク上で連続するブロックが1つの要求にまとまるように、bs[]をブロック番号順に並べ替える。
+// すべての要求を発行してから完了を待つので、デバイスのキューに複数の要求が並ぶ。
+void
+bwritev(struct buf **bs, int n)
+{
+  struct buf *b;
+  int i, j;
+
+  for(i = 0; i < n; i++){
+    if(!holdingsleep(&bs[i]->lock))
+      panic("bwritev");
+    // 挿入ソート。nはログの大きさ程度なので十分速い。
+    b = bs[i];
+    for(j = i; j > 0 && bs[j-1]->blockno > b->blockno; j--)
+      bs[j] = bs[j-1];
+    bs[j] = b;
+  }
+  virtio_disk_submit(bs, n, 1, 0);
+  for(i = 0; i < n; i++)
+    virtio_disk_wait(bs[i]);
+}
+
+// バッファbの参照を1つ減らす。
+// 誰も使っていなければ、置き換えの順序を決めるために最後に使われた時刻を記録し、
+// 空きバッファを待っているプロセスを起こす。
+static void
+bunref(struct buf *b)
+{
+  struct bucket *bk;
+  int wake = 0;
+
+  bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
+  acquire(&bk->lock);
+  b->refcnt--;
+  if (b->refcnt == 0) {
+    // 誰も待っていない。
+    b->lastuse = ticks;
+    wake = bcache.nwait > 0;
+  }
+  release(&bk->lock);
+
+  // bget()がbcache.lockを保持したまま眠りにつくので、起こし損ねることはない。
+  if(wake){
+    acquire(&bcache.lock);
+    wakeup(&bcache);
+    release(&bcache.lock);
+  }
+}
+
 // ロックされたバッファを解放する関数である。
-// 最も最近使用されたリストの先頭に移動する。
 void
 brelse(struct buf *b)
 {
@@ -119,34 +426,69 @@ brelse(struct buf *b)
     panic("brelse");
 
   releasesleep(&b->lock);
+  bunref(b);
+}
 
-  acquire(&bcache.lock);
-  b->refcnt--;
-  if (b->refcnt == 0) {
-    // 誰も待っていない。
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+// dev上のn個のブロックblocknos[]の読み込みをまとめて開始し、完了を待たずに戻る関数である。
+// すでにキャッシュにあるか読み込み中のブロックは飛ばす。nはRAMAX以下でなければならない。
+// 読み込み中のバッファはロックされたままなので、後のbread()は完了まで待つことになる。
+// ディスクリプタが足りずに発行できなかったブロックは、待たずに手放してあきらめる。
+void
+breadahead(uint dev, uint *blocknos, int n)
+{
+  struct buf *bs[RAMAX], *b;
+  struct bucket *bk;
+  int i, k = 0;
+
+  if(n > RAMAX)
+    panic("breadahead");
+  for(i = 0; i < n; i++){
+    bk = &bcache.bucket[BHASH(dev, blocknos[i])];
+    acquire(&bk->lock);
+    b = bucket_find(bk, dev, blocknos[i]);
+    release(&bk->lock);
+    if(b)
+      continue;
+
+    b = bget(dev, blocknos[i]);
+    if(b->valid)
+      brelse(b);
+    else
+      bs[k++] = b;
   }
+  if(k > 0)
+    i = virtio_disk_submit(bs, k, 0, 1);
+  for(; i < k; i++)
+    brelse(bs[i]);
+}
 
-  release(&bcache.lock);
+// breadahead()で開始した読み込みが完了したときに、
+// 割り込みハンドラから呼ばれる関数である。
+// 読み込みを開始したプロセスに代わってバッファのロックと参照を手放す。
+void
+biodone(struct buf *b)
+{
+  b->valid = 1;
+  releasesleep(&b->lock);
+  bunref(b);
 }
 
 // バッファの参照カウントを増加させる関数である。
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
+
+  acquire(&bk->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 // バッファの参照カウントを減少させる関数である。
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
+
+  acquire(&bk->lock);
   b->refcnt--;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
@@ -1,11 +1,13 @@
 struct buf {
   int valid;   // データがディスクから読み込まれたかどうかを示すフラグである。
   int disk;    // ディスクがこのバッファを「所有」しているかどうかを示すフラグである。
+  int qid;     // 読み書きの要求を入れたvirtqueueの番号である。
   uint dev;    // デバイス番号である。
   uint blockno; // ブロック番号である。
   struct sleeplock lock; // バッファのスリープロックである。
   uint refcnt; // バッファの参照カウントである。
-  struct buf *prev; // 最も最近使用された（LRU）キャッシュリストの前のバッファである。
-  struct buf *next; // 最も最近使用された（LRU）キャッシュリストの次のバッファである。
-  uchar data[BSIZE]; // バッファのデータである。
+  uint lastuse; // 最後に解放されたときのticksである。置き換えるバッファの選択に使う。
+  struct buf *prev; // ハッシュ表のバケットのリストの前のバッファである。
+  struct buf *next; // ハッシュ表のバケットのリストの次のバッファである。
+  uchar *data; // バッファのデータである。kalloc()したページの一部を指す。
 };
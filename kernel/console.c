@@ -104,9 +104,14 @@ consoleread(int user_dst, uint64 dst, int n)
     }
 
     // 入力バイトをユーザースペースのバッファにコピーする。
+    // ページを用意するために眠ることがあるので、ロックを手放してからコピーする。
     cbuf = c;
-    if(either_copyout(user_dst, dst, &cbuf, 1) == -1)
+    release(&cons.lock);
+    if(either_copyout(user_dst, dst, &cbuf, 1) == -1){
+      acquire(&cons.lock);
       break;
+    }
+    acquire(&cons.lock);
 
     dst++;
     --n;
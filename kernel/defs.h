@@ -1,9 +1,13 @@
+struct bcachestat;
 struct buf;
+struct diskstat;
 struct context;
 struct file;
 struct inode;
 struct pipe;
 struct proc;
+struct segment;
+struct vma;
 struct spinlock;
 struct sleeplock;
 struct stat;
@@ -12,10 +16,16 @@ struct superblock;
 // bio.c
 void            binit(void);                            // バッファキャッシュを初期化する関数である。
 struct buf*     bread(uint, uint);                      // ディスクからバッファにブロックを読み込む関数である。
+struct buf*     bnew(uint, uint);                       // ディスクから読まずにブロックのバッファを得る関数である。
 void            brelse(struct buf*);                    // バッファを解放する関数である。
 void            bwrite(struct buf*);                    // バッファの内容をディスクに書き込む関数である。
 void            bpin(struct buf*);                      // バッファを固定する関数である。
 void            bunpin(struct buf*);                    // バッファの固定を解除する関数である。
+void            bwritev(struct buf**, int);             // 複数のバッファをまとめてディスクに書き込む関数である。
+void            breadahead(uint, uint*, int);           // 複数のブロックの先読みを開始する関数である。
+void            biodone(struct buf*);                   // 非同期の読み込みの完了を処理する関数である。
+int             bshrink(void);                          // メモリ不足のときにバッファキャッシュを縮小する関数である。
+void            bstat(struct bcachestat*);              // バッファキャッシュの統計情報を取得する関数である。
 
 // console.c
 void            consoleinit(void);                      // コンソールを初期化する関数である。
@@ -24,6 +34,8 @@ void            consputc(int);                          // コンソールに文
 
 // exec.c
 int             exec(char*, char**);                    // 新しいプログラムを実行する関数である。
+int             loadseg(struct proc*, struct segment*, uint64, char*); // プログラムセグメントの1ページを読み込む関数である。
+void            segshrink(struct proc*, uint64);        // 縮めたヒープに合わせてプログラムセグメントを切り詰める関数である。
 
 // file.c
 struct file*    filealloc(void);                        // ファイル構造体を割り当てる関数である。
@@ -36,10 +48,15 @@ int             filewrite(struct file*, uint64, int n); // ファイルにデー
 
 // fs.c
 void            fsinit(int);                            // ファイルシステムを初期化する関数である。
+void            dcacheforget(struct inode*, char*);     // ディレクトリエントリキャッシュからエントリを取り除く関数である。
 int             dirlink(struct inode*, char*, uint);    // ディレクトリエントリをリンクする関数である。
 struct inode*   dirlookup(struct inode*, char*, uint*); // ディレクトリエントリを検索する関数である。
-struct inode*   ialloc(uint, short);                    // inodeを割り当てる関数である。
+struct inode*   ialloc(uint, short, uint);              // inodeを割り当てる関数である。
 struct inode*   idup(struct inode*);                    // inodeの参照カウントを増加させる関数である。
+int             igetwrite(struct inode*);               // inodeを書き込み用に開く関数である。実行中なら-1を返す。
+void            iputwrite(struct inode*);               // igetwrite()で開いた書き込みを閉じる関数である。
+int             idenywrite(struct inode*);              // 実行中のinodeへの書き込みを拒否させる関数である。
+void            iallowwrite(struct inode*);             // idenywrite()による拒否を取り消す関数である。
 void            iinit(void);                            // inodeシステムを初期化する関数である。
 void            ilock(struct inode*);                   // inodeをロックする関数である。
 void            iput(struct inode*);                    // inodeを解放する関数である。
@@ -119,6 +136,10 @@ void            uvmfirst(pagetable_t, uchar *, uint);   // 最初のページを
 uint64          uvmalloc(pagetable_t, uint64, uint64, int); // ユーザー仮想メモリにページを割り当てる関数である。
 uint64          uvmdealloc(pagetable_t, uint64, uint64); // ユーザー仮想メモリからページを解放する関数である。
 int             uvmcopy(pagetable_t, pagetable_t, uint64); // ユーザー仮想メモリをコピーする関数である。
+int             uvmcopyrange(pagetable_t, pagetable_t, uint64, uint64, int); // ユーザー仮想メモリの範囲をコピーまたは共有する関数である。
+int             uvmcow(pagetable_t, uint64);            // コピーオンライトページを書き込み可能にする関数である。
+int             uvmfault(struct proc*, uint64, int);    // ユーザーページフォルトを処理する関数である。
+uint64          uvmprefault(uint64, uint64, int);       // ユーザーページを前もってフォルトさせる関数である。
 void            uvmfree(pagetable_t, uint64);           // ユーザー仮想メモリを解放する関数である。
 void            uvmunmap(pagetable_t, uint64, uint64, int); // ユーザー仮想メモリのマッピングを解除する関数である。
 void            uvmclear(pagetable_t, uint64);          // ユーザー仮想メモリをクリアする関数である。
@@ -137,6 +158,10 @@ void            plic_complete(int);                     // PLICへの割り込
 // virtio_disk.c
 void            virtio_disk_init(void);                 // Virtioディスクを初期化する関数である。
 void            virtio_disk_rw(struct buf *, int);      // Virtioディスクの読み書きを行う関数である。
+int             virtio_disk_submit(struct buf **, int, int, int); // Virtioディスクに複数の要求をまとめて発行する関数である。
+void            virtio_disk_wait(struct buf *);         // Virtioディスクの要求の完了を待つ関数である。
+void            virtio_disk_stat(struct diskstat *);    // Virtioディスクの統計情報を取得する関数である。
+uint64          virtio_disk_poll(uint64);               // Virtioディスクの完了をポーリングする時間を設定する関数である。
 void            virtio_disk_intr(void);                 // Virtioディスクの割り込み処理関数である。
 
 // 固定サイズ配列の要素数である。
@@ -146,12 +171,33 @@ void            virtio_disk_intr(void);                 // Virtioディスクの
 void*           kalloc(void);                           // カーネルメモリを割り当てる関数である。
 void            kfree(void*);                           // カーネルメモリを解放する関数である。
 void            kinit(void);                            // カーネルメモリの初期化関数である。
+void*           kalloc_reclaim(void);                   // 必要ならバッファキャッシュを縮小してページを割り当てる関数である。
+void*           kalloc_order(int);                      // 2^orderページの連続した物理メモリを割り当てる関数である。
+void            kfree_order(void*, int);                // kalloc_order()で割り当てたメモリを解放する関数である。
+int             kalloc_nfree(int);                      // オーダーごとの空きブロック数を返す関数である。
+void            krefinc(void*);                         // ページの参照カウントを増加させる関数である。
+int             krefcnt(void*);                         // ページの参照カウントを返す関数である。
 
 // log.c
 void            initlog(int, struct superblock*);       // ログを初期化する関数である。
 void            log_write(struct buf*);                 // バッファの内容をログに書き込む関数である。
 void            begin_op(void);                         // ログ操作の開始を通知する関数である。
+void            begin_opn(int);                         // 予約するブロック数を指定してログ操作の開始を通知する関数である。
+int             log_opmax(void);                        // 1つのログ操作が予約できる最大のブロック数を返す関数である。
+void            log_free(uint);                         // トランザクションで解放したブロックを記録する関数である。
+int             log_logged(uint);                       // ブロックをログを通さずに書けないかどうかを返す関数である。
 void            end_op(void);                           // ログ操作の終了を通知する関数である。
+void            log_sync(void);                         // 終わった操作がコミットされるまで待つ関数である。
+
+// mmap.c
+uint64          mmap(struct file*, uint64, int, int, uint); // ファイルや匿名メモリをマッピングする関数である。
+int             munmap(struct proc*, uint64, uint64);   // マッピングを解除する関数である。
+void            munmapall(struct proc*);                // すべてのマッピングを解除する関数である。
+struct vma*     findvma(struct proc*, uint64);          // アドレスを含むマッピングを探す関数である。
+uint64          mmapbase(struct proc*);                 // マッピングの最も低いアドレスを返す関数である。
+int             mmapload(struct vma*, uint64, char*);   // マッピングの1ページを用意する関数である。
+int             mmapprefork(struct proc*);              // fork前に共有マッピングのページを用意する関数である。
+int             mmapfork(struct proc*, struct proc*);   // マッピングを子プロセスに引き継ぐ関数である。
 
 // pipe.c
 int             pipealloc(struct file**, struct file**);// パイプを割り当てる関数である。
@@ -5,14 +5,11 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "defs.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
 #include "elf.h"
 
-// プログラムセグメントを仮想アドレスvaにロードする関数である。
-// vaはページ境界にアラインされている必要がある。
-// vaからva+szまでのページはすでにマッピングされている必要がある。
-// 成功時は0を返し、失敗時は-1を返す。
-static int loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz);
-
 int flags2perm(int flags)
 {
     int perm = 0;
@@ -24,15 +21,18 @@ int flags2perm(int flags)
 }
 
 // 指定されたパスのプログラムを実行する関数である。
+// プログラムセグメントはここでは読み込まず、範囲だけをp->seg[]に記録する。
+// 各ページは最初にアクセスされたときにloadseg()がinodeから読み込む。
 int
 exec(char *path, char **argv)
 {
   char *s, *last;
-  int i, off;
+  int i, off, nseg = 0;
   uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase;
   struct elfhdr elf;
-  struct inode *ip;
+  struct inode *ip, *exe = 0, *oldexe;
   struct proghdr ph;
+  struct segment seg[MAXSEG];
   pagetable_t pagetable = 0, oldpagetable;
   struct proc *p = myproc();
 
@@ -55,7 +55,7 @@ exec(char *path, char **argv)
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
-  // プログラムをメモリにロードする。
+  // プログラムセグメントを記録する。ページはマッピングせずに残しておく。
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -67,15 +67,28 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
-    uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz, flags2perm(ph.flags))) == 0)
+    if(ph.off + ph.filesz < ph.off || ph.off + ph.filesz > ip->size)
+      goto bad;
+    if(ph.vaddr + ph.memsz > TRAPFRAME)
       goto bad;
-    sz = sz1;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(nseg >= MAXSEG)
       goto bad;
+    seg[nseg].va = ph.vaddr;
+    seg[nseg].memsz = ph.memsz;
+    seg[nseg].off = ph.off;
+    seg[nseg].filesz = ph.filesz;
+    seg[nseg].perm = flags2perm(ph.flags);
+    nseg++;
+    if(ph.vaddr + ph.memsz > sz)
+      sz = ph.vaddr + ph.memsz;
   }
-  iunlockput(ip);
+  // ページフォルト時に読み込むため、inodeへの参照は保持したままにする。
+  // まだ読み込んでいないページが書き換わらないよう、その間の書き込みを拒否する。
+  if(idenywrite(ip) < 0)
+    goto bad;
+  iunlock(ip);
   end_op();
+  exe = ip;
   ip = 0;
 
   p = myproc();
@@ -128,11 +141,22 @@ exec(char *path, char **argv)
 
   // ユーザーイメージにコミットする。
   oldpagetable = p->pagetable;
+  oldexe = p->exe;
+  munmapall(p);
   p->pagetable = pagetable;
   p->sz = sz;
+  p->exe = exe;
+  p->nseg = nseg;
+  memmove(p->seg, seg, sizeof(seg));
   p->trapframe->epc = elf.entry;  // 初期プログラムカウンタ = main
   p->trapframe->sp = sp; // 初期スタックポインタ
   proc_freepagetable(oldpagetable, oldsz);
+  if(oldexe){
+    iallowwrite(oldexe);
+    begin_op();
+    iput(oldexe);
+    end_op();
+  }
 
   return argc; // これがa0に格納され、main(argc, argv)の最初の引数になる。
 
@@ -143,30 +167,61 @@ exec(char *path, char **argv)
     iunlockput(ip);
     end_op();
   }
+  if(exe){
+    iallowwrite(exe);
+    begin_op();
+    iput(exe);
+    end_op();
+  }
   return -1;
 }
 
-// プログラムセグメントを仮想アドレスvaにpagetableにロードする関数である。
-// vaはページアラインされている必要がある。
-// vaからva+szまでのページはすでにマッピングされている必要がある。
+// プログラムセグメントsのうち仮想アドレスvaを含む1ページ分を
+// p->exeから読み込み、カーネルアドレスmemに書き込む関数である。
+// memはゼロで埋められている必要があり、ファイルに含まれない部分はゼロのまま残る。
+// inodeを読むために眠るので、uvmfault()と同じくスピンロックを保持したまま呼んではならない。
 // 成功時は0を返し、失敗時は-1を返す。
-static int
-loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
+int
+loadseg(struct proc *p, struct segment *s, uint64 va, char *mem)
 {
-  uint i, n;
-  uint64 pa;
-
-  for(i = 0; i < sz; i += PGSIZE){
-    pa = walkaddr(pagetable, va + i);
-    if(pa == 0)
-      panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
-      return -1;
-  }
+  uint64 pgoff;
+  uint n;
 
+  if(p->exe == 0)
+    return -1;
+
+  pgoff = PGROUNDDOWN(va) - s->va;
+  if(pgoff >= s->filesz)
+    return 0; // bss部分なのでゼロのままでよい。
+  n = s->filesz - pgoff;
+  if(n > PGSIZE)
+    n = PGSIZE;
+
+  ilock(p->exe);
+  if(readi(p->exe, 0, (uint64)mem, s->off + pgoff, n) != n){
+    iunlock(p->exe);
+    return -1;
+  }
+  iunlock(p->exe);
   return 0;
 }
+
+// sbrk()でヒープをszまで縮めたときに、プログラムセグメントをszまでに切り詰める関数である。
+// 解放した範囲を再び伸ばしたときは、ファイルの内容ではなくゼロのページを用意させる。
+void
+segshrink(struct proc *p, uint64 sz)
+{
+  struct segment *s;
+
+  sz = PGROUNDUP(sz);
+  for(s = p->seg; s < &p->seg[p->nseg]; s++){
+    if(s->va >= sz){
+      s->memsz = 0;
+      s->filesz = 0;
+    } else if(s->va + s->memsz > sz){
+      s->memsz = sz - s->va;
+      if(s->filesz > s->memsz)
+        s->filesz = s->memsz;
+    }
+  }
+}
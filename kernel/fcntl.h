@@ -3,3 +3,11 @@
 #define O_RDWR    0x002   // ファイルを読み書き両用で開くフラグである。
 #define O_CREATE  0x200   // ファイルが存在しない場合、新しく作成するフラグである。
 #define O_TRUNC   0x400   // ファイルを開く際に、既存の内容を切り捨てるフラグである。
+
+#define PROT_READ      0x1   // マッピングを読み取り可能にするフラグである。
+#define PROT_WRITE     0x2   // マッピングを書き込み可能にするフラグである。
+#define PROT_EXEC      0x4   // マッピングを実行可能にするフラグである。
+
+#define MAP_SHARED     0x01  // 書き込みをファイルと他のプロセスに反映するフラグである。
+#define MAP_PRIVATE    0x02  // 書き込みをプロセス内のコピーにとどめるフラグである。
+#define MAP_ANONYMOUS  0x20  // ファイルではなくゼロで埋めたメモリをマッピングするフラグである。
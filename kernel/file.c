@@ -80,6 +80,8 @@ fileclose(struct file *f)
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
   } else if(ff.type == FD_INODE || ff.type == FD_DEVICE){
+    if(ff.type == FD_INODE && ff.writable)
+      iputwrite(ff.ip);
     begin_op();
     iput(ff.ip);
     end_op();
@@ -115,13 +117,42 @@ fileread(struct file *f, uint64 addr, int n)
   if(f->readable == 0)
     return -1;
 
+  // パイプはスピンロックを、inodeはスリープロックを保持したままcopyout()するので、
+  // その前にユーザーページを用意し、用意できた分だけを読む。
   if(f->type == FD_PIPE){
-    r = piperead(f->pipe, addr, n);
+    // 1ページ分ずつ用意しては読み、その分を満たせたら続きを読む。
+    int i = 0;
+    while(i < n){
+      int n1 = n - i;
+      if(n1 > PGSIZE)
+        n1 = PGSIZE;
+      if((n1 = uvmprefault(addr + i, n1, 1)) == 0)
+        break;
+      if((r = piperead(f->pipe, addr + i, n1)) < 0)
+        break;
+      i += r;
+      if(r != n1)
+        break;
+    }
+    if(r >= 0)
+      r = i;
   } else if(f->type == FD_DEVICE){
+    // デバイスはロックを保持せずにcopyout()するので、ページを用意しなくてよい。
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].read)
       return -1;
     r = devsw[f->major].read(1, addr, n);
   } else if(f->type == FD_INODE){
+    // ファイルの終わりを超える分は転送されない。
+    // プログラムセグメントのページの読み込みは同じinodeをロックしうるため、
+    // ロックを手放してからページを用意する。
+    ilock(f->ip);
+    if(n < 0 || f->off >= f->ip->size)
+      n = 0;
+    else if(n > f->ip->size - f->off)
+      n = f->ip->size - f->off;
+    iunlock(f->ip);
+    if(n > 0 && (n = uvmprefault(addr, n, 1)) == 0)
+      return -1;
     ilock(f->ip);
     if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
       f->off += r;
@@ -138,13 +169,28 @@ fileread(struct file *f, uint64 addr, int n)
 int
 filewrite(struct file *f, uint64 addr, int n)
 {
-  int r, ret = 0;
+  int r = 0, ret = 0;
 
   if(f->writable == 0)
     return -1;
 
+  // fileread()と同じ理由で、パイプとinodeはcopyin()の前にユーザーページを用意しておく。
+  // 一度に用意するのは1ページ分ずつとし、書き込む分だけにとどめる。
   if(f->type == FD_PIPE){
-    ret = pipewrite(f->pipe, addr, n);
+    int i = 0;
+    while(i < n){
+      int n1 = n - i;
+      if(n1 > PGSIZE)
+        n1 = PGSIZE;
+      if((n1 = uvmprefault(addr + i, n1, 0)) == 0)
+        break;
+      if((r = pipewrite(f->pipe, addr + i, n1)) < 0)
+        break;
+      i += r;
+      if(r != n1)
+        break;
+    }
+    ret = (r < 0 ? -1 : i);
   } else if(f->type == FD_DEVICE){
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].write)
       return -1;
@@ -154,16 +200,19 @@ filewrite(struct file *f, uint64 addr, int n)
     // i-node、間接ブロック、アロケーションブロック、および
     // 非整列書き込み用の2ブロックを含む
     // 最大ログトランザクションサイズを超えないようにする。
+    // 各操作は書き込む量に必要な分だけログを予約する。
     // これは本来、writei()がデバイス（例えばコンソール）のようなものを書き込むかもしれないため、
     // より低い位置にあるべきものである。
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+    int max = ((log_opmax()-1-1-2) / 2) * BSIZE;
     int i = 0;
     while(i < n){
       int n1 = n - i;
       if(n1 > max)
         n1 = max;
 
-      begin_op();
+      if((n1 = uvmprefault(addr + i, n1, 0)) == 0)
+        break;
+      begin_opn(((n1 + BSIZE - 1) / BSIZE) * 2 + 1 + 1 + 2);
       ilock(f->ip);
       if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
         f->off += r;
@@ -18,15 +18,27 @@ struct inode {
   uint dev;           // デバイス番号である。
   uint inum;          // inode番号である。
   int ref;            // 参照カウントである。
+  int nwrite;         // 書き込み用に開いているファイルの数である。itable.lockで保護される。
+  int nexec;          // このinodeを実行しているプロセスの数である。itable.lockで保護される。
   struct sleeplock lock; // 以下のすべてのフィールドを保護するスリープロックである。
   int valid;          // inodeがディスクから読み込まれているかどうかを示すフラグである。
+  uint raoff;         // 直前のreadi()が読み終えたオフセットである。次の読み出しがここからなら順次読み出しとみなす。
+  uint rawin;         // 先読みするブロック数である。順次読み出しが続くとRAMAXまで倍々に広げる。
+  uint raend;         // 先読みを発行済みの範囲の次の論理ブロック番号である。
 
   short type;         // ディスクinodeのコピーである。
   short major;        // メジャーデバイス番号である。
   short minor;        // マイナーデバイス番号である。
   short nlink;        // ハードリンクの数である。
   uint size;          // ファイルサイズである。
-  uint addrs[NDIRECT+1]; // ディスクブロックアドレスの配列である。
+  uint addrs[NDIRECT+NLEVEL]; // ディスクブロックアドレスの配列である。
+  uint mapbn;         // bmap()が最後に使った最下段の間接ブロックが指す最初の論理ブロック番号である。
+  uint mapblk;        // その間接ブロックのブロック番号である。0ならキャッシュしていない。
+  uint goal;          // 次にブロックを割り当てるときに優先するブロック番号である。0なら指定しない。
+
+  struct inode *hnext; // ハッシュ表の同じバケットの次のinodeである。itable.lockで保護される。
+  struct inode *next;  // 参照されていないinodeのLRUリストである。itable.lockで保護される。
+  struct inode *prev;
 };
 
 // メジャーデバイス番号をデバイス関数にマップする構造体である。
@@ -21,10 +21,16 @@
 #include "file.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
+#define NORDERED 32  // writei()がログを通さずにまとめて書き込むデータブロックの最大数
+#define NBMAP    64  // 空きの数をメモリに持つビットマップブロックの最大数（ビットマップごと）
 
 // ディスクデバイスごとに一つのスーパーブロックがあるべきであるが、我々は一つのデバイスで動作する。
 struct superblock sb;
 
+static void bitmapinit(int dev);
+static void dcacheinit(void);
+static void dcachepurge(uint dev, uint inum);
+
 // スーパーブロックを読み込む関数である。
 static void
 readsb(int dev, struct superblock *sb)
@@ -42,7 +48,10 @@ fsinit(int dev) {
   readsb(dev, &sb);
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
+  if(sb.bsize != BSIZE)
+    panic("fsinit: block size differs from the kernel's BSIZE");
   initlog(dev, &sb);
+  bitmapinit(dev);
 }
 
 // ブロックをゼロクリアする関数である。
@@ -59,48 +68,169 @@ bzero(int dev, int bno)
 
 // ブロック。
 
-// ゼロクリアされたディスクブロックを割り当てる関数である。
-// ディスクスペースがない場合は0を返す。
-static uint
-balloc(uint dev)
+// ビットマップの全走査を避けるため、ビットマップブロックごとの空きの数と、
+// 次に探し始める位置（カーソル）をメモリに持つ。これらは起動時にビットマップから作り、
+// 以降は割り当てと解放のたびに更新する。ビットマップそのものはbufのロックで守られる。
+// データブロックのビットマップとinodeのビットマップで同じ仕組みを使う。
+struct freemap {
+  struct spinlock lock;
+  uint bmapstart;      // 最初のビットマップブロックのブロック番号である。
+  uint n;              // ビットの数である。
+  uint cursor;         // 次に探し始めるビットである。
+  int nfree[NBMAP];    // ビットマップブロックごとの空きの数である。
+};
+
+struct freemap bfreemap;  // データブロックのビットマップである。
+struct freemap ifreemap;  // inodeのビットマップである。
+
+// bmapstartから始まるnビットのビットマップを読んで空きの数の表を作る関数である。
+// ログの回復の後に呼ぶ。
+static void
+freemapinit(struct freemap *fm, char *name, int dev, uint bmapstart, uint n)
 {
-  int b, bi, m;
   struct buf *bp;
+  uint b, bi;
+
+  initlock(&fm->lock, name);
+  if((n + BPB - 1) / BPB > NBMAP)
+    panic("freemapinit: too many bitmap blocks");
+  fm->bmapstart = bmapstart;
+  fm->n = n;
+  fm->cursor = 0;
+  for(b = 0; b < n; b += BPB){
+    bp = bread(dev, bmapstart + b / BPB);
+    for(bi = 0; bi < BPB && b + bi < n; bi++)
+      if((bp->data[bi/8] & (1 << (bi % 8))) == 0)
+        fm->nfree[b / BPB]++;
+    brelse(bp);
+  }
+}
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // ブロックが空いているか？
-        bp->data[bi/8] |= m;  // 使用中としてマークする。
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
-      }
+// データブロックとinodeのビットマップの空きの数の表を作る関数である。
+static void
+bitmapinit(int dev)
+{
+  freemapinit(&bfreemap, "bfreemap", dev, sb.bmapstart, sb.size);
+  freemapinit(&ifreemap, "ifreemap", dev, sb.ibmapstart, sb.ninodes);
+  // データブロックはメタデータの後ろから探し始める。
+  bfreemap.cursor = sb.size - sb.nblocks;
+}
+
+// ビットマップブロックbpの中で、ビットb以降の空きを探して使用中にする関数である。
+// 使用中のバイトは読み飛ばす。見つからなければ0を返す。
+static uint
+freemapclaim(struct freemap *fm, struct buf *bp, uint b)
+{
+  uint bi, base = b - b % BPB;
+
+  for(bi = b % BPB; bi < BPB && base + bi < fm->n; bi++){
+    if(bi % 8 == 0 && bp->data[bi/8] == 0xff){
+      bi += 7;
+      continue;
+    }
+    if((bp->data[bi/8] & (1 << (bi % 8))) == 0){  // 空いているか？
+      bp->data[bi/8] |= 1 << (bi % 8);  // 使用中としてマークする。
+      log_write(bp);
+      return base + bi;
     }
-    brelse(bp);
   }
-  printf("balloc: out of blocks\n");
   return 0;
 }
 
-// ディスクブロックを解放する関数である。
-static void
-bfree(int dev, uint b)
+// ビットマップから空きを1つ割り当て、その番号を返す関数である。
+// goalが0でなければ、goalかその後ろの同じビットマップブロック内の空きを優先する。
+// それ以外は、カーソルから空きのあるビットマップブロックを順に探す。
+// ビット0は常に使用中であり、空きがない場合は0を返す。
+static uint
+freemapalloc(struct freemap *fm, int dev, uint goal)
+{
+  struct buf *bp;
+  uint start, b, n, i, nbmap = (fm->n + BPB - 1) / BPB;
+
+  acquire(&fm->lock);
+  start = fm->cursor;
+  if(goal && goal < fm->n && fm->nfree[goal / BPB] > 0)
+    start = goal;
+  release(&fm->lock);
+
+  // 最初のビットマップブロックはstartから、それ以降は先頭から探す。
+  b = 0;
+  for(i = 0; i < nbmap; i++){
+    n = (start / BPB + i) % nbmap;
+    acquire(&fm->lock);
+    if(fm->nfree[n] == 0){
+      release(&fm->lock);
+      continue;
+    }
+    release(&fm->lock);
+    bp = bread(dev, fm->bmapstart + n);
+    b = freemapclaim(fm, bp, i == 0 ? start : n * BPB);
+    if(b == 0 && i == 0)
+      b = freemapclaim(fm, bp, n * BPB);
+    brelse(bp);
+    if(b)
+      break;
+  }
+  if(b == 0)
+    return 0;
+
+  acquire(&fm->lock);
+  fm->nfree[b / BPB]--;
+  fm->cursor = b + 1 < fm->n ? b + 1 : 0;
+  release(&fm->lock);
+  return b;
+}
+
+// ビットマップのビットbを空きに戻す関数である。すでに空いていれば-1を返す。
+static int
+freemapfree(struct freemap *fm, int dev, uint b)
 {
   struct buf *bp;
   int bi, m;
 
-  bp = bread(dev, BBLOCK(b, sb));
+  bp = bread(dev, fm->bmapstart + b / BPB);
   bi = b % BPB;
   m = 1 << (bi % 8);
-  if((bp->data[bi/8] & m) == 0)
-    panic("freeing free block");
+  if((bp->data[bi/8] & m) == 0){
+    brelse(bp);
+    return -1;
+  }
   bp->data[bi/8] &= ~m;
   log_write(bp);
   brelse(bp);
+
+  acquire(&fm->lock);
+  fm->nfree[b / BPB]++;
+  release(&fm->lock);
+  return 0;
+}
+
+// ゼロクリアされたディスクブロックを割り当てる関数である。
+// zeroが0なら、ゼロクリアをログに書かずに割り当てる。呼び出し元がブロック全体を書き込む。
+// goalが0でなければ、goalの近くの空きブロックを優先する。
+// ディスクスペースがない場合は0を返す。
+static uint
+balloc(uint dev, int zero, uint goal)
+{
+  uint b;
+
+  if((b = freemapalloc(&bfreemap, dev, goal)) == 0){
+    printf("balloc: out of blocks\n");
+    return 0;
+  }
+  if(zero)
+    bzero(dev, b);
+  return b;
+}
+
+// ディスクブロックを解放する関数である。
+static void
+bfree(int dev, uint b)
+{
+  // 他のプロセスが再利用する前に記録しておく。
+  log_free(b);
+  if(freemapfree(&bfreemap, dev, b) < 0)
+    panic("freeing free block");
 }
 
 // Inodes。
@@ -145,24 +275,103 @@ bfree(int dev, uint b)
 // itable.lockスピンロックはitableエントリの割り当てを保護する。
 // ip->refがエントリが空いているかどうかを示し、ip->devおよびip->inumがエントリが保持しているinodeを示すため、これらのフィールドを使用する際にはitable.lockを保持する必要がある。
 
+// inodeは(dev, inum)のハッシュ表で引く。参照がなくなったinodeもハッシュ表に残し、
+// LRUリストにつないでおく。同じinodeが再び使われればディスクから読み直さずに済む。
+// inodeはkalloc()のページからNINODEまで必要に応じて増やし、それ以上はLRUリストの
+// 最も古いinodeを再利用する。
+
 // ip->lockスリープロックはref、dev、およびinum以外のすべてのipフィールドを保護する。
 // ip->valid、ip->size、ip->typeなどを読み書きするためにはip->lockを保持する必要がある。
 
+// ハッシュ表のバケット数である。衝突を減らすため素数にしている。
+#define NIHASH 127
+
+// (dev, inum)からバケットの番号を求める。
+#define IHASH(dev, inum) (((dev) * 31 + (inum)) % NIHASH)
+
+// 1ページに入るinodeの数である。
+#define IPP (PGSIZE / sizeof(struct inode))
+
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct inode *hash[NIHASH];  // inodeのハッシュ表である。
+  struct inode lru;            // 参照されていないinodeの双方向リストの番兵である。先頭ほど最近使われた。
+  void *page[NINODE/IPP];      // inodeを置いたページである。
+  int ninode;                  // 確保したinodeの数である。
 } itable;
 
+// inode ipをLRUリストの先頭に入れる。itable.lockを保持している必要がある。
+static void
+lru_insert(struct inode *ip)
+{
+  ip->next = itable.lru.next;
+  ip->prev = &itable.lru;
+  itable.lru.next->prev = ip;
+  itable.lru.next = ip;
+}
+
+// inode ipをLRUリストから外す。itable.lockを保持している必要がある。
+static void
+lru_remove(struct inode *ip)
+{
+  ip->next->prev = ip->prev;
+  ip->prev->next = ip->next;
+}
+
+// inode ipをハッシュ表から外す。itable.lockを保持している必要がある。
+static void
+ihash_remove(struct inode *ip)
+{
+  struct inode **pp;
+
+  for(pp = &itable.hash[IHASH(ip->dev, ip->inum)]; *pp; pp = &(*pp)->hnext){
+    if(*pp == ip){
+      *pp = ip->hnext;
+      return;
+    }
+  }
+  panic("ihash_remove");
+}
+
+// ページを1つ確保して、IPP個の未使用のinodeをLRUリストの末尾に加える。
+// itable.lockを保持している必要がある。
+// 上限に達しているかメモリが足りない場合は-1を返す。
+static int
+igrow(void)
+{
+  struct inode *ip;
+  char *mem;
+  int i, j;
+
+  for(i = 0; i < NELEM(itable.page); i++)
+    if(itable.page[i] == 0)
+      break;
+  if(i == NELEM(itable.page) || (mem = kalloc()) == 0)
+    return -1;
+  itable.page[i] = mem;
+
+  // 空のinodeはinum == 0であり、ハッシュ表には入れない。
+  for(j = 0; j < IPP; j++){
+    ip = (struct inode*)mem + j;
+    memset(ip, 0, sizeof(*ip));
+    initsleeplock(&ip->lock, "inode");
+    ip->next = &itable.lru;
+    ip->prev = itable.lru.prev;
+    itable.lru.prev->next = ip;
+    itable.lru.prev = ip;
+  }
+  itable.ninode += IPP;
+  return 0;
+}
+
 // ファイルシステムを初期化する関数である。
 void
 iinit()
 {
-  int i = 0;
-
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
-  }
+  itable.lru.next = &itable.lru;
+  itable.lru.prev = &itable.lru;
+  dcacheinit();
 }
 
 // デバイスdev上のinodeを取得する関数である。
@@ -170,30 +379,38 @@ static struct inode* iget(uint dev, uint inum);
 
 // デバイスdev上のinodeを割り当てる関数である。
 // 種類を指定して割り当て済みとしてマークする。
+// inodeのビットマップから空きを探し、nearが0でなければその近く（親ディレクトリのinodeなど）を優先する。
+// 近いinodeは同じinodeブロックに入るので、ディレクトリとその中身をまとめて読める。
 // ロックされていないが割り当て済みで参照されたinodeを返す。
 // 空きinodeがない場合はNULLを返す。
 struct inode*
-ialloc(uint dev, short type)
+ialloc(uint dev, short type, uint near)
 {
-  int inum;
+  uint inum;
   struct buf *bp;
   struct dinode *dip;
 
-  for(inum = 1; inum < sb.ninodes; inum++){
-    bp = bread(dev, IBLOCK(inum, sb));
-    dip = (struct dinode*)bp->data + inum%IPB;
-
-    if(dip->type == 0){  // 空いているinodeであるか？
-      memset(dip, 0, sizeof(*dip));
-      dip->type = type;
-      log_write(bp);   // ディスク上に割り当て済みとしてマークする。
-      brelse(bp);
-      return iget(dev, inum);
-    }
-    brelse(bp);
+  if((inum = freemapalloc(&ifreemap, dev, near)) == 0){
+    printf("ialloc: no inodes\n");
+    return 0;
   }
-  printf("ialloc: no inodes\n");
-  return 0;
+  bp = bread(dev, IBLOCK(inum, sb));
+  dip = (struct dinode*)bp->data + inum%IPB;
+  if(dip->type != 0)
+    panic("ialloc: inode in use");
+  memset(dip, 0, sizeof(*dip));
+  dip->type = type;
+  log_write(bp);   // ディスク上に割り当て済みとしてマークする。
+  brelse(bp);
+  return iget(dev, inum);
+}
+
+// ディスク上のinodeをinodeのビットマップで空きに戻す関数である。
+static void
+ifree(uint dev, uint inum)
+{
+  if(freemapfree(&ifreemap, dev, inum) < 0)
+    panic("freeing free inode");
 }
 
 // 修正されたメモリ内のinodeをディスクにコピーする関数である。
@@ -223,31 +440,45 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip;
 
   acquire(&itable.lock);
 
   // inodeがすでにテーブルにあるか？
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
+  for(ip = itable.hash[IHASH(dev, inum)]; ip; ip = ip->hnext){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref == 0)
+        lru_remove(ip);
       ip->ref++;
       release(&itable.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // 空きスロットを覚えておく。
-      empty = ip;
   }
 
-  // inodeエントリをリサイクルする。
-  if(empty == 0)
+  // 未使用のinodeがなければ上限までinodeを増やし、
+  // それ以上は最も長く使われていないinodeを再利用する。
+  if(itable.lru.prev == &itable.lru || itable.lru.prev->inum != 0)
+    igrow();
+  if(itable.lru.prev == &itable.lru)
     panic("iget: no inodes");
+  ip = itable.lru.prev;
+  lru_remove(ip);
+  if(ip->inum)
+    ihash_remove(ip);
 
-  ip = empty;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
+  ip->nwrite = 0;
+  ip->nexec = 0;
   ip->valid = 0;
+  ip->raoff = 0;
+  ip->rawin = 0;
+  ip->raend = 0;
+  ip->mapblk = 0;
+  ip->goal = 0;
+  ip->hnext = itable.hash[IHASH(dev, inum)];
+  itable.hash[IHASH(dev, inum)] = ip;
   release(&itable.lock);
 
   return ip;
@@ -264,6 +495,57 @@ idup(struct inode *ip)
   return ip;
 }
 
+// ipを書き込み用に開く関数である。
+// 実行中のプログラムであれば書き込ませずに-1を返す。
+int
+igetwrite(struct inode *ip)
+{
+  int r = -1;
+
+  acquire(&itable.lock);
+  if(ip->nexec == 0){
+    ip->nwrite++;
+    r = 0;
+  }
+  release(&itable.lock);
+  return r;
+}
+
+// igetwrite()で開いた書き込みを閉じる関数である。
+void
+iputwrite(struct inode *ip)
+{
+  acquire(&itable.lock);
+  ip->nwrite--;
+  release(&itable.lock);
+}
+
+// ipを実行中のプログラムとし、書き込みを拒否させる関数である。
+// デマンドページングでまだ読み込まれていないページが書き換わるのを防ぐ。
+// 書き込み用に開かれていれば-1を返す。
+int
+idenywrite(struct inode *ip)
+{
+  int r = -1;
+
+  acquire(&itable.lock);
+  if(ip->nwrite == 0){
+    ip->nexec++;
+    r = 0;
+  }
+  release(&itable.lock);
+  return r;
+}
+
+// idenywrite()による拒否を取り消す関数である。
+void
+iallowwrite(struct inode *ip)
+{
+  acquire(&itable.lock);
+  ip->nexec--;
+  release(&itable.lock);
+}
+
 // 指定されたinodeをロックする関数である。
 // 必要に応じてディスクからinodeを読み込む。
 void
@@ -323,9 +605,12 @@ iput(struct inode *ip)
 
     release(&itable.lock);
 
+    if(ip->type == T_DIR)
+      dcachepurge(ip->dev, ip->inum);
     itrunc(ip);
     ip->type = 0;
     iupdate(ip);
+    ifree(ip->dev, ip->inum);
     ip->valid = 0;
 
     releasesleep(&ip->lock);
@@ -334,6 +619,8 @@ iput(struct inode *ip)
   }
 
   ip->ref--;
+  if(ip->ref == 0)
+    lru_insert(ip);
   release(&itable.lock);
 }
 
@@ -350,49 +637,148 @@ iunlockput(struct inode *ip)
 // 各inodeに関連付けられた内容（データ）は、ディスク上のブロックに格納される。
 // 最初のNDIRECTブロック番号はip->addrs[]にリストされる。
 // 次のNINDIRECTブロックはip->addrs[NDIRECT]ブロックにリストされる。
+// その次のNDINDIRECTブロックはip->addrs[NDIRECT+1]の二重間接ブロックから、
+// 最後のNTINDIRECTブロックはip->addrs[NDIRECT+2]の三重間接ブロックからたどる。
+// bmap()は最後に使った最下段の間接ブロックを覚えておき、順次アクセスでは上の段をたどらない。
+
+// inode ipのためにブロックを割り当てる関数である。
+// 直前に割り当てたブロックの次を目標にして、ファイルのブロックがディスク上で連続するようにする。
+static uint
+bmapalloc(struct inode *ip, int zero)
+{
+  uint addr;
+
+  addr = balloc(ip->dev, zero, ip->goal);
+  if(addr)
+    ip->goal = addr + 1;
+  return addr;
+}
+
+// ブロックを割り当てて間接ブロックbpのa[i]に記録する。
+// dataが0でなければデータブロックとして、zeroに従ってゼロクリアする。
+// allocが0なら割り当てず、a[i]をそのまま返す。
+static uint
+bmapslot(struct inode *ip, struct buf *bp, uint i, int alloc, int data, int zero, int *fresh)
+{
+  uint *a = (uint*)bp->data;
+  uint addr;
+
+  if((addr = a[i]) == 0 && alloc){
+    addr = bmapalloc(ip, data ? zero : 1);
+    if(addr){
+      a[i] = addr;
+      log_write(bp);
+      if(data && !zero)
+        *fresh = 1;
+    }
+  }
+  return addr;
+}
 
 // inode ipのnthブロックのディスクブロックアドレスを返す関数である。
-// そのようなブロックが存在しない場合、bmapは一つを割り当てる。
+// allocが0でなく、そのようなブロックが存在しない場合は一つを割り当てる。
+// allocが0なら割り当てず、ブロックがなければ0を返す。
+// freshが0でなく、ipが通常ファイルであれば、データブロックはゼロクリアをログに書かずに割り当て、
+// *freshを1にする。呼び出し元はそのブロック全体を書き込まなければならない。
 // ディスクスペースがない場合は0を返す。
 static uint
-bmap(struct inode *ip, uint bn)
+bmapwalk(struct inode *ip, uint bn, int alloc, int *fresh)
 {
-  uint addr, *a;
+  uint addr, span, base, level, i;
   struct buf *bp;
+  int zero = fresh == 0 || ip->type != T_FILE;
 
   if(bn < NDIRECT){
-    if((addr = ip->addrs[bn]) == 0){
-      addr = balloc(ip->dev);
+    if((addr = ip->addrs[bn]) == 0 && alloc){
+      addr = bmapalloc(ip, zero);
       if(addr == 0)
         return 0;
       ip->addrs[bn] = addr;
+      if(!zero)
+        *fresh = 1;
     }
     return addr;
   }
-  bn -= NDIRECT;
 
-  if(bn < NINDIRECT){
-    // 間接ブロックをロードし、必要に応じて割り当てる。
-    if((addr = ip->addrs[NDIRECT]) == 0){
-      addr = balloc(ip->dev);
-      if(addr == 0)
-        return 0;
-      ip->addrs[NDIRECT] = addr;
+  // 直前と同じ最下段の間接ブロックに含まれるなら、それを直接使う。
+  if(ip->mapblk && bn >= ip->mapbn && bn - ip->mapbn < NINDIRECT){
+    bp = bread(ip->dev, ip->mapblk);
+    addr = bmapslot(ip, bp, bn - ip->mapbn, alloc, 1, zero, fresh);
+    brelse(bp);
+    return addr;
+  }
+
+  // 何段の間接ブロックを使うかを決める。
+  base = NDIRECT;
+  span = NINDIRECT;
+  for(level = 1; level <= NLEVEL; level++){
+    if(bn - base < span)
+      break;
+    base += span;
+    span *= NINDIRECT;
+  }
+  if(level > NLEVEL)
+    panic("bmap: out of range");
+
+  // 最上段の間接ブロックを必要に応じて割り当てる。
+  if((addr = ip->addrs[NDIRECT+level-1]) == 0){
+    if(!alloc)
+      return 0;
+    addr = bmapalloc(ip, 1);
+    if(addr == 0)
+      return 0;
+    ip->addrs[NDIRECT+level-1] = addr;
+  }
+
+  // 間接ブロックを上の段から順にたどり、必要に応じて割り当てる。
+  bn -= base;
+  for(; level > 0; level--){
+    span /= NINDIRECT;
+    i = bn / span;
+    bn %= span;
+    if(level == 1){
+      ip->mapbn = base;
+      ip->mapblk = addr;
     }
     bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      addr = balloc(ip->dev);
-      if(addr){
-        a[bn] = addr;
-        log_write(bp);
-      }
-    }
+    addr = bmapslot(ip, bp, i, alloc, level == 1, zero, fresh);
     brelse(bp);
-    return addr;
+    if(addr == 0)
+      return 0;
+    base += i * span;
   }
+  return addr;
+}
+
+// inode ipのnthブロックのディスクブロックアドレスを返す関数である。
+// そのようなブロックが存在しない場合、bmapは一つを割り当てる。
+// freshについてはbmapwalk()を参照。
+static uint
+bmap(struct inode *ip, uint bn, int *fresh)
+{
+  return bmapwalk(ip, bn, 1, fresh);
+}
 
-  panic("bmap: out of range");
+// level段の間接ブロックaddrと、そこからたどれるすべてのブロックを解放する。
+static void
+indfree(uint dev, uint addr, int level)
+{
+  struct buf *bp;
+  uint *a;
+  int j;
+
+  bp = bread(dev, addr);
+  a = (uint*)bp->data;
+  for(j = 0; j < NINDIRECT; j++){
+    if(a[j] == 0)
+      continue;
+    if(level > 1)
+      indfree(dev, a[j], level-1);
+    else
+      bfree(dev, a[j]);
+  }
+  brelse(bp);
+  bfree(dev, addr);
 }
 
 // inodeをトランケートする関数である（内容を破棄する）。
@@ -400,9 +786,7 @@ bmap(struct inode *ip, uint bn)
 void
 itrunc(struct inode *ip)
 {
-  int i, j;
-  struct buf *bp;
-  uint *a;
+  int i;
 
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
@@ -411,17 +795,14 @@ itrunc(struct inode *ip)
     }
   }
 
-  if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
+  for(i = 0; i < NLEVEL; i++){
+    if(ip->addrs[NDIRECT+i]){
+      indfree(ip->dev, ip->addrs[NDIRECT+i], i+1);
+      ip->addrs[NDIRECT+i] = 0;
     }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
   }
+  ip->mapblk = 0;
+  ip->goal = 0;
 
   ip->size = 0;
   iupdate(ip);
@@ -439,6 +820,49 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// readi()が[off, off+n)を読む前に呼ばれ、順次読み出しであれば
+// 続くブロックの読み込みを完了を待たずに開始する。
+// 読み出すブロック自体も含めてまとめて発行するので、複数ブロックの読み出しも一度にディスクに渡る。
+// 順次読み出しが続くたびに先読みの窓をRAMAXまで倍に広げ、途切れたら閉じる。
+// 呼び出し元はip->lockを保持している必要がある。
+static void
+readahead(struct inode *ip, uint off, uint n)
+{
+  uint bn, end, nblocks, addrs[RAMAX];
+  int k = 0;
+
+  if(n == 0)
+    return;
+  if(off != ip->raoff){
+    // 順次読み出しではない。
+    ip->raoff = off + n;
+    ip->rawin = 0;
+    ip->raend = 0;
+    return;
+  }
+  ip->raoff = off + n;
+  ip->rawin = ip->rawin ? min(ip->rawin * 2, RAMAX) : RAMIN;
+
+  nblocks = (ip->size + BSIZE - 1) / BSIZE;
+  end = min((off + n - 1) / BSIZE + 1 + ip->rawin, nblocks);
+  bn = off / BSIZE;
+  if(bn < ip->raend)
+    bn = ip->raend; // すでに発行済み
+  for(; bn < end; bn++){
+    // ファイルサイズの範囲内なのでbmap()がブロックを割り当てることはない。
+    if((addrs[k] = bmap(ip, bn, 0)) == 0)
+      break;
+    if(++k == RAMAX){
+      breadahead(ip->dev, addrs, k);
+      k = 0;
+    }
+  }
+  if(k > 0)
+    breadahead(ip->dev, addrs, k);
+  if(bn > ip->raend)
+    ip->raend = bn;
+}
+
 // inodeからデータを読み取る関数である。
 // 呼び出し元はip->lockを保持している必要がある。
 // user_dst==1の場合、dstはユーザ仮想アドレスである。
@@ -454,8 +878,10 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
   if(off + n > ip->size)
     n = ip->size - off;
 
+  readahead(ip, off, n);
+
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    uint addr = bmap(ip, off/BSIZE);
+    uint addr = bmap(ip, off/BSIZE, 0);
     if(addr == 0)
       break;
     bp = bread(ip->dev, addr);
@@ -470,17 +896,38 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
   return tot;
 }
 
+// writei()が新しく割り当てたn個のデータブロックbs[]をまとめてホームロケーションに書き込み、解放する。
+static void
+writedirect(struct buf **bs, int n)
+{
+  int i;
+
+  if(n == 0)
+    return;
+  bwritev(bs, n);
+  for(i = 0; i < n; i++)
+    brelse(bs[i]);
+}
+
 // inodeにデータを書き込む関数である。
 // 呼び出し元はip->lockを保持している必要がある。
 // user_src==1の場合、srcはユーザ仮想アドレスである。
 // それ以外の場合、srcはカーネルアドレスである。
 // 成功したバイト数を返す。
 // 返された値が要求されたnより少ない場合、何らかのエラーが発生している。
+//
+// 通常ファイルに新しく割り当てたデータブロックはログを通さず、
+// 戻る前にホームロケーションに直接書き込む（ordered mode）。
+// そのブロックを指すi-nodeや間接ブロック、ビットマップの更新は呼び出し元のトランザクションで
+// 後からコミットされるので、コミットされたメタデータが書かれていないデータを指すことはない。
+// ただし、チェックポイント前のログに同じブロックの古い内容があれば、それが後で上書きしないように
+// ログを通して書く。
 int
 writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 {
   uint tot, m;
-  struct buf *bp;
+  struct buf *bp, *direct[NORDERED];
+  int ndirect = 0, fresh, err;
 
   if(off > ip->size || off + n < off)
     return -1;
@@ -488,18 +935,38 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
     return -1;
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    uint addr = bmap(ip, off/BSIZE);
+    fresh = 0;
+    uint addr = bmap(ip, off/BSIZE, &fresh);
     if(addr == 0)
       break;
-    bp = bread(ip->dev, addr);
+    if(fresh){
+      // ディスク上の内容は使わないので読み込まない。
+      bp = bnew(ip->dev, addr);
+      memset(bp->data, 0, BSIZE);
+    } else {
+      bp = bread(ip->dev, addr);
+    }
     m = min(n - tot, BSIZE - off%BSIZE);
-    if(either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
+    err = either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1;
+    if(err && !fresh){
       brelse(bp);
       break;
     }
-    log_write(bp);
-    brelse(bp);
+    // 割り当てたブロックは、コピーに失敗してもゼロで埋めて書き込む。
+    if(fresh && !log_logged(addr)){
+      direct[ndirect++] = bp;
+      if(ndirect == NORDERED){
+        writedirect(direct, ndirect);
+        ndirect = 0;
+      }
+    } else {
+      log_write(bp);
+      brelse(bp);
+    }
+    if(err)
+      break;
   }
+  writedirect(direct, ndirect);
 
   if(off > ip->size)
     ip->size = off;
@@ -520,42 +987,349 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+// 名前が"."か".."であれば、ヘッダーでのエントリの位置（0か1）を返し、それ以外は-1を返す。
+static int
+dotslot(char *name)
+{
+  if(namecmp(name, ".") == 0)
+    return 0;
+  if(namecmp(name, "..") == 0)
+    return 1;
+  return -1;
+}
+
+// ディレクトリdpのbn番目のブロックを読み、ロックして返す関数である。
+// bnがディレクトリの末尾であれば、ゼロクリアしたブロックを割り当ててディレクトリを伸ばす。
+// dirlink()とdirsplit()だけが使い、名前の検索にはdirread()を使う。
+// ディスクスペースがない場合は0を返す。
+static struct buf*
+dirblock(struct inode *dp, uint bn)
+{
+  uint addr;
+
+  if((addr = bmap(dp, bn, 0)) == 0)
+    return 0;
+  if(bn * BSIZE >= dp->size){
+    dp->size = (bn + 1) * BSIZE;
+    iupdate(dp);
+  }
+  return bread(dp->dev, addr);
+}
+
+// ディレクトリdpのbn番目のブロックを読み、ロックして返す関数である。
+// dirblock()と違ってブロックを割り当てず、ディレクトリを伸ばすこともない。
+// bnがディレクトリの末尾を越えているか、ブロックがなければ0を返す。
+static struct buf*
+dirread(struct inode *dp, uint bn)
+{
+  uint addr;
+
+  if((uint64)bn * BSIZE >= dp->size)
+    return 0;
+  if((addr = bmapwalk(dp, bn, 0, 0)) == 0)
+    return 0;
+  return bread(dp->dev, addr);
+}
+
+// ディレクトリdpの名前nameのエントリが入る葉ブロックの番号を返す関数である。
+// hpはヘッダーである。
+static uint
+dirleaf(struct buf *hp, char *name)
+{
+  return DIRLEAF(hp->data, dirhash(name) & ((1 << DIRDEPTH(hp->data)) - 1));
+}
+
+// ディレクトリエントリキャッシュ。
+
+// (ディレクトリのinode, 名前)からエントリのinode番号とディレクトリ内のオフセットを引くキャッシュである。
+// 名前が存在しないこと（inum == 0）も覚えておく。
+// エントリはディレクトリをロックしたdirlookup()とdirlink()が登録し、ディレクトリを変更する
+// dirlink()、dirsplit()、sys_unlink()が書き換えるか取り除く。
+// 検索はdcache.lockだけを取り、ディレクトリのスリープロックを取らない。
+// dcache.lockを保持したままitable.lockを取ってよいが、逆は許されない。
+
+// ハッシュ表のバケット数である。
+#define NDHASH 127
+
+struct dentry {
+  uint dev;
+  uint dinum;           // ディレクトリのinode番号である。0なら未使用である。
+  char name[DIRSIZ];
+  uint inum;            // エントリのinode番号である。0なら名前が存在しない。
+  uint off;             // ディレクトリ内でのエントリのバイトオフセットである。
+  struct dentry *hnext; // ハッシュ表の同じバケットの次のエントリである。
+  struct dentry *next;  // LRUリストである。先頭ほど最近使われた。
+  struct dentry *prev;
+};
+
+struct {
+  struct spinlock lock;
+  struct dentry dentry[NDENTRY];
+  struct dentry *hash[NDHASH];
+  struct dentry lru;    // LRUリストの番兵である。
+} dcache;
+
+// (dev, dinum, name)からバケットの番号を求める。
+static uint
+dhash(uint dev, uint dinum, char *name)
+{
+  return (dev * 31 + dinum * 17 + dirhash(name)) % NDHASH;
+}
+
+// ディレクトリエントリキャッシュを初期化する関数である。
+static void
+dcacheinit(void)
+{
+  struct dentry *d;
+
+  initlock(&dcache.lock, "dcache");
+  dcache.lru.next = &dcache.lru;
+  dcache.lru.prev = &dcache.lru;
+  for(d = dcache.dentry; d < &dcache.dentry[NDENTRY]; d++){
+    d->next = dcache.lru.next;
+    d->prev = &dcache.lru;
+    dcache.lru.next->prev = d;
+    dcache.lru.next = d;
+  }
+}
+
+// エントリdをLRUリストの先頭に移す。dcache.lockを保持している必要がある。
+static void
+dtouch(struct dentry *d)
+{
+  d->next->prev = d->prev;
+  d->prev->next = d->next;
+  d->next = dcache.lru.next;
+  d->prev = &dcache.lru;
+  dcache.lru.next->prev = d;
+  dcache.lru.next = d;
+}
+
+// エントリdをハッシュ表から外して未使用にし、LRUリストの末尾に移す。
+// dcache.lockを保持している必要がある。
+static void
+dremove(struct dentry *d)
+{
+  struct dentry **pp;
+
+  for(pp = &dcache.hash[dhash(d->dev, d->dinum, d->name)]; *pp; pp = &(*pp)->hnext){
+    if(*pp == d){
+      *pp = d->hnext;
+      break;
+    }
+  }
+  d->dinum = 0;
+  d->next->prev = d->prev;
+  d->prev->next = d->next;
+  d->prev = dcache.lru.prev;
+  d->next = &dcache.lru;
+  dcache.lru.prev->next = d;
+  dcache.lru.prev = d;
+}
+
+// ディレクトリdpの名前nameのエントリを探す。dcache.lockを保持している必要がある。
+static struct dentry*
+dfind(struct inode *dp, char *name)
+{
+  struct dentry *d;
+
+  for(d = dcache.hash[dhash(dp->dev, dp->inum, name)]; d; d = d->hnext)
+    if(d->dev == dp->dev && d->dinum == dp->inum && namecmp(d->name, name) == 0)
+      return d;
+  return 0;
+}
+
+// ディレクトリdpの名前nameをキャッシュから探す関数である。
+// 見つかれば1を返し、名前が存在すれば参照を取ったinodeを、存在しなければ0を*ipに設定する。
+// poffが0でなければエントリのオフセットを設定する。キャッシュになければ0を返す。
+// dpをロックしている必要はない。
+static int
+dcachelookup(struct inode *dp, char *name, struct inode **ip, uint *poff)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if((d = dfind(dp, name)) == 0){
+    release(&dcache.lock);
+    return 0;
+  }
+  dtouch(d);
+  // エントリを取り除くプロセスはdcache.lockを待つので、inodeが解放される前に参照を取れる。
+  *ip = d->inum ? iget(dp->dev, d->inum) : 0;
+  if(poff)
+    *poff = d->off;
+  release(&dcache.lock);
+  return 1;
+}
+
+// ディレクトリdpの名前nameのエントリ（inum, off）を登録する関数である。
+// inumが0なら名前が存在しないことを登録する。dpをロックしている必要がある。
+static void
+dcacheput(struct inode *dp, char *name, uint inum, uint off)
+{
+  struct dentry *d;
+  uint h;
+
+  acquire(&dcache.lock);
+  if((d = dfind(dp, name)) == 0){
+    // 最も長く使われていないエントリを再利用する。
+    d = dcache.lru.prev;
+    if(d->dinum)
+      dremove(d);
+    d->dev = dp->dev;
+    d->dinum = dp->inum;
+    strncpy(d->name, name, DIRSIZ);
+    h = dhash(d->dev, d->dinum, d->name);
+    d->hnext = dcache.hash[h];
+    dcache.hash[h] = d;
+  }
+  d->inum = inum;
+  d->off = off;
+  dtouch(d);
+  release(&dcache.lock);
+}
+
+// ディレクトリdpの名前nameのエントリをキャッシュから取り除く関数である。
+// ディレクトリからエントリを消すときに、dpをロックしたまま呼ぶ。
+void
+dcacheforget(struct inode *dp, char *name)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if((d = dfind(dp, name)) != 0)
+    dremove(d);
+  release(&dcache.lock);
+}
+
+// デバイスdev上のディレクトリinumのエントリをすべて取り除く関数である。
+// ディレクトリのinodeを解放するときに呼び、inode番号が再利用されたときに古いエントリが残らないようにする。
+static void
+dcachepurge(uint dev, uint inum)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  for(d = dcache.dentry; d < &dcache.dentry[NDENTRY]; d++)
+    if(d->dinum == inum && d->dev == dev)
+      dremove(d);
+  release(&dcache.lock);
+}
+
 // ディレクトリ内のディレクトリエントリを探す関数である。
+// まずディレクトリエントリキャッシュを調べ、なければ
+// "."と".."はヘッダーを、それ以外は名前のハッシュから索引で求めた葉ブロックを1つだけ調べる。
 // 見つかった場合、エントリのバイトオフセットを*poffに設定する。
 struct inode*
 dirlookup(struct inode *dp, char *name, uint *poff)
 {
-  uint off, inum;
-  struct dirent de;
+  uint bn, inum, off;
+  struct inode *ip;
+  struct buf *bp;
+  struct dirent *de;
+  int i;
 
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
+  if(dcachelookup(dp, name, &ip, poff))
+    return ip;
+  if(dp->size == 0)
+    return 0;
 
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlookup read");
-    if(de.inum == 0)
+  if((bp = dirread(dp, 0)) == 0)
+    panic("dirlookup read");
+  bn = 0;
+  if((i = dotslot(name)) < 0){
+    bn = dirleaf(bp, name);
+    brelse(bp);
+    // 索引が指す葉がディレクトリの外にあれば、名前は存在しないものとする。
+    if((bp = dirread(dp, bn)) == 0)
+      return 0;
+  }
+
+  for(de = (struct dirent*)bp->data; de < (struct dirent*)(bp->data + BSIZE); de++){
+    if(de->inum == 0)
       continue;
-    if(namecmp(name, de.name) == 0){
+    if((i < 0 || de - (struct dirent*)bp->data == i) && namecmp(name, de->name) == 0){
       // エントリがパス要素と一致する。
+      off = bn * BSIZE + (de - (struct dirent*)bp->data) * sizeof(*de);
       if(poff)
         *poff = off;
-      inum = de.inum;
+      inum = de->inum;
+      brelse(bp);
+      dcacheput(dp, name, inum, off);
       return iget(dp->dev, inum);
     }
   }
+  brelse(bp);
+
+  dcacheput(dp, name, 0, 0);
+  return 0;
+}
+
+// 一杯になった葉ブロックbp（ディレクトリ内のbn番目）を分割する関数である。
+// ハッシュの次のビットが1のエントリを新しい葉に移し、それを指すように索引を書き換える。
+// 索引の表が足りなければ倍にする。成功した場合は0を、表を大きくできないか
+// ディスクブロックがない場合は-1を返す。
+static int
+dirsplit(struct inode *dp, struct buf *hp, struct buf *bp, uint bn)
+{
+  uint i, n, depth, ld, nb, size;
+  struct buf *np;
+  struct dirent *de, *nde;
+
+  // この葉を指す索引の数から、葉の区別に使われているビット数ldを求める。
+  depth = DIRDEPTH(hp->data);
+  size = 1 << depth;
+  n = 0;
+  for(i = 0; i < size; i++)
+    if(DIRLEAF(hp->data, i) == bn)
+      n++;
+  for(ld = depth; n > 1; n >>= 1)
+    ld--;
+
+  if(ld == depth){
+    if(size * 2 > DIRNIDX)
+      return -1;
+    for(i = 0; i < size; i++)
+      DIRLEAF(hp->data, size + i) = DIRLEAF(hp->data, i);
+    DIRDEPTH(hp->data) = ++depth;
+    size *= 2;
+  }
 
+  nb = dp->size / BSIZE;
+  if((np = dirblock(dp, nb)) == 0)
+    return -1;
+  for(i = 0; i < size; i++)
+    if(DIRLEAF(hp->data, i) == bn && (i >> ld) & 1)
+      DIRLEAF(hp->data, i) = nb;
+
+  nde = (struct dirent*)np->data;
+  for(de = (struct dirent*)bp->data; de < (struct dirent*)(bp->data + BSIZE); de++){
+    if(de->inum && (dirhash(de->name) >> ld) & 1){
+      dcacheforget(dp, de->name);  // オフセットが変わる
+      *nde++ = *de;
+      memset(de, 0, sizeof(*de));
+    }
+  }
+  log_write(hp);
+  log_write(bp);
+  log_write(np);
+  brelse(np);
   return 0;
 }
 
 // 新しいディレクトリエントリ（name, inum）をディレクトリdpに書き込む関数である。
+// 空のディレクトリにはヘッダーと最初の葉を作る。葉が一杯であれば分割してから書き込む。
 // 成功した場合は0を返し、失敗した場合（例：ディスクブロックがない場合）は-1を返す。
 int
 dirlink(struct inode *dp, char *name, uint inum)
 {
-  int off;
-  struct dirent de;
+  struct buf *hp, *bp;
+  struct dirent *de;
   struct inode *ip;
+  uint bn;
+  int i;
 
   // 名前が存在しないことを確認する。
   if((ip = dirlookup(dp, name, 0)) != 0){
@@ -563,20 +1337,53 @@ dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
-  // 空のディレクトリエントリを探す。
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlink read");
-    if(de.inum == 0)
-      break;
+  if(dp->size == 0){
+    if((hp = dirblock(dp, 0)) == 0)
+      return -1;
+    DIRLEAF(hp->data, 0) = 1;
+    log_write(hp);
+    brelse(hp);
+    if((bp = dirblock(dp, 1)) == 0)
+      return -1;
+    brelse(bp);
   }
 
-  strncpy(de.name, name, DIRSIZ);
-  de.inum = inum;
-  if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+  if((hp = dirblock(dp, 0)) == 0)
     return -1;
+  if((i = dotslot(name)) >= 0){
+    de = (struct dirent*)hp->data + i;
+    strncpy(de->name, name, DIRSIZ);
+    de->inum = inum;
+    log_write(hp);
+    brelse(hp);
+    dcacheput(dp, name, inum, i * sizeof(*de));
+    return 0;
+  }
 
-  return 0;
+  for(;;){
+    bn = dirleaf(hp, name);
+    if((bp = dirblock(dp, bn)) == 0)
+      break;
+    // 空のディレクトリエントリを探す。
+    for(de = (struct dirent*)bp->data; de < (struct dirent*)(bp->data + BSIZE); de++){
+      if(de->inum == 0){
+        strncpy(de->name, name, DIRSIZ);
+        de->inum = inum;
+        log_write(bp);
+        dcacheput(dp, name, inum, bn * BSIZE + (de - (struct dirent*)bp->data) * sizeof(*de));
+        brelse(bp);
+        brelse(hp);
+        return 0;
+      }
+    }
+    if(dirsplit(dp, hp, bp, bn) < 0){
+      brelse(bp);
+      break;
+    }
+    brelse(bp);
+  }
+  brelse(hp);
+  return -1;
 }
 
 // パス
@@ -633,6 +1440,15 @@ namex(char *path, int nameiparent, char *name)
     ip = idup(myproc()->cwd);
 
   while((path = skipelem(path, name)) != 0){
+    // キャッシュにあれば、ディレクトリをロックせずに次の要素に進む。
+    // キャッシュにエントリがあるのはディレクトリだけである。
+    if(!(nameiparent && *path == '\0') && dcachelookup(ip, name, &next, 0)){
+      iput(ip);
+      if(next == 0)
+        return 0;
+      ip = next;
+      continue;
+    }
     ilock(ip);
     if(ip->type != T_DIR){
       iunlockput(ip);
@@ -2,11 +2,13 @@
 // カーネルとユーザープログラムの両方がこのヘッダーファイルを使用する。
 
 #define ROOTINO  1   // ルートi-number
-#define BSIZE 1024  // ブロックサイズ
+#ifndef BSIZE
+#define BSIZE 4096  // ブロックサイズ（Makefileで-DBSIZEとして変えられる）
+#endif
 
 // ディスクレイアウト:
 // [ ブートブロック | スーパーブロック | ログ | inodeブロック |
-//                                          フリービットマップ | データブロック]
+//                          inodeビットマップ | フリービットマップ | データブロック]
 //
 // mkfsはスーパーブロックを計算し、初期ファイルシステムを構築する。
 // スーパーブロックはディスクレイアウトを記述する。
@@ -19,13 +21,20 @@ struct superblock {
   uint logstart;     // 最初のログブロックのブロック番号。
   uint inodestart;   // 最初のinodeブロックのブロック番号。
   uint bmapstart;    // 最初のフリーマップブロックのブロック番号。
+  uint nlogtrans;    // 1つのログトランザクションの最大ブロック数。
+  uint maxop;        // FS操作が既定で予約するログのブロック数。
+  uint ibmapstart;   // 最初のinodeビットマップブロックのブロック番号。
+  uint bsize;        // ブロックサイズ（バイト単位）。
 };
 
 #define FSMAGIC 0x10203040
 
-#define NDIRECT 12
+#define NDIRECT 10
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define NDINDIRECT (NINDIRECT * NINDIRECT)
+#define NTINDIRECT (NDINDIRECT * NINDIRECT)
+#define NLEVEL 3  // 間接ブロックの段数の最大値
+#define MAXFILE (NDIRECT + NINDIRECT + NDINDIRECT + NTINDIRECT)
 
 // ディスク上のinode構造体
 struct dinode {
@@ -34,7 +43,7 @@ struct dinode {
   short minor;          // マイナーデバイス番号（T_DEVICEのみ）。
   short nlink;          // ファイルシステム内のinodeへのリンク数。
   uint size;            // ファイルサイズ（バイト単位）。
-  uint addrs[NDIRECT+1];   // データブロックのアドレス。
+  uint addrs[NDIRECT+NLEVEL];   // データブロック、単一・二重・三重間接ブロックのアドレス。
 };
 
 // ブロックあたりのinode数。
@@ -49,6 +58,9 @@ struct dinode {
 // ブロックbのビットを含むフリーマップのブロック
 #define BBLOCK(b, sb) ((b)/BPB + sb.bmapstart)
 
+// inode iのビットを含むinodeビットマップのブロック
+#define IBBLOCK(i, sb) ((i)/BPB + sb.ibmapstart)
+
 // ディレクトリはdirent構造体のシーケンスを含むファイルである。
 #define DIRSIZ 14
 
@@ -56,3 +68,33 @@ struct dirent {
   ushort inum;          // inode番号。
   char name[DIRSIZ];    // 名前。
 };
+
+// ディレクトリは名前のハッシュで索引付けされる（拡張ハッシュ法）。
+// 最初のブロックはヘッダーであり、先頭の2つのエントリは"."と".."である。
+// 残りはinumが0のdirindexであり、ハッシュの下位depthビットから葉ブロックを引く表を持つ。
+// 2番目以降のブロックは葉であり、dirent構造体を並べる。
+// 索引はinumが0なので、ディレクトリを順に読むプログラムからは空きエントリに見える。
+struct dirindex {
+  ushort inum;          // 常に0。
+  ushort depth;         // ヘッダーの最初のdirindexのみ: 表の大きさの2を底とする対数。
+  uint leaf[3];         // 葉ブロックのディレクトリ内でのブロック番号。
+};
+
+// ヘッダーに入る索引の数
+#define DIRNIDX ((BSIZE / sizeof(struct dirent) - 2) * 3)
+
+// ヘッダーのデータhdrの索引の表の大きさの対数と、i番目の索引
+#define DIRDEPTH(hdr)   (((struct dirindex*)(hdr) + 2)->depth)
+#define DIRLEAF(hdr, i) (((struct dirindex*)(hdr) + 2 + (i) / 3)->leaf[(i) % 3])
+
+// ディレクトリの索引に使う名前のハッシュ（FNV-1a）
+static inline uint
+dirhash(const char *name)
+{
+  uint h = 2166136261U;
+  int i;
+
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = (h ^ (unsigned char)name[i]) * 16777619U;
+  return h;
+}
@@ -1,6 +1,19 @@
 // ユーザープロセス、カーネルスタック、ページテーブルページ、
 // パイプバッファのための物理メモリアロケータ。
 // 4096バイトのページ全体を割り当てる。
+//
+// [end, PHYSTOP)はバディアロケータで管理する。オーダーoのブロックは
+// 2^oページの物理的に連続した領域で、アドレスはそのサイズにアラインされている。
+// 解放時には隣接するバディも空いていれば結合して一つ上のオーダーに戻す。
+// kalloc_order()/kfree_order()で複数ページの連続領域を扱える。
+//
+// 1ページ（オーダー0）の割り当ては各CPU専用の空きリストで完結させる。
+// ローカルリストが空になるとバディアロケータからKBATCHページをまとめて補充し、
+// それも空なら他のCPUのリストの半分を横取りする。
+// ローカルリストが2*KBATCHページを超えるとKBATCHページをバディアロケータへ戻す。
+//
+// kalloc()で割り当てたページは参照カウントを持つ。コピーオンライトのforkで
+// 複数のページテーブルから共有されたページは、最後のkfree()で初めて解放される。
 
 #include "types.h"
 #include "param.h"
@@ -9,7 +22,21 @@
 #include "riscv.h"
 #include "defs.h"
 
+// CPUごとの空きリストとバディアロケータの間で一度に移動するページ数である。
+#define KBATCH 32
+
+// 管理対象の物理ページ数と、物理アドレスからページ番号への変換である。
+#define NPAGE ((PHYSTOP - KERNBASE) / PGSIZE)
+#define PAGEIDX(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+
+// オーダーoのブロックのバイト数である。
+#define BLKSIZE(o) ((uint64)PGSIZE << (o))
+
+// kmem.order[]で、そのページが空きブロックの先頭でないことを表す値である。
+#define NOTFREE 0xff
+
 void freerange(void *pa_start, void *pa_end);
+static void kcheck(void);
 
 extern char end[]; // カーネルの終了アドレス。
 // kernel.ldで定義されている。
@@ -18,9 +45,26 @@ struct run {
   struct run *next; // 次の空きページを指すポインタ。
 };
 
+// バディアロケータの空きブロック。ブロックの先頭に置かれる。
+struct block {
+  struct block *next;
+  struct block *prev;
+};
+
+// CPUごとの空きリストである。
+struct kcpu {
+  struct spinlock lock; // 他のCPUによる横取りからリストを保護するスピンロック。
+  struct run *freelist; // このCPUの空きページのリスト。
+  int nfree;            // freelist内のページ数。
+};
+
 struct {
-  struct spinlock lock; // 物理メモリの割り当て/解放を保護するスピンロック。
-  struct run *freelist; // 空きページのリスト。
+  struct spinlock lock;          // バディアロケータを保護するスピンロック。
+  struct block free[MAXORDER+1]; // オーダーごとの空きブロックの双方向循環リストの番兵。
+  int nfree[MAXORDER+1];         // オーダーごとの空きブロック数。
+  uchar order[NPAGE];            // 空きブロックの先頭ページならそのオーダー、それ以外はNOTFREE。
+  int ref[NPAGE];                // kalloc()で割り当てたページの参照カウント。
+  struct kcpu cpu[NCPU];         // CPUごとの空きリスト。
 } kmem;
 
 // 物理メモリアロケータを初期化する関数である。
@@ -28,41 +72,225 @@ void
 kinit()
 {
   initlock(&kmem.lock, "kmem");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kmem.cpu[i].lock, "kmem_cpu");
+  for(int o = 0; o <= MAXORDER; o++){
+    kmem.free[o].next = &kmem.free[o];
+    kmem.free[o].prev = &kmem.free[o];
+  }
+  memset(kmem.order, NOTFREE, sizeof(kmem.order));
   freerange(end, (void*)PHYSTOP);
+  kcheck();
+}
+
+// オーダーoの空きリストにブロックを追加する関数である。
+// kmem.lockを保持している必要がある。
+static void
+blk_push(void *pa, int o)
+{
+  struct block *b = (struct block*)pa;
+
+  b->next = kmem.free[o].next;
+  b->prev = &kmem.free[o];
+  kmem.free[o].next->prev = b;
+  kmem.free[o].next = b;
+  kmem.order[PAGEIDX(pa)] = o;
+  kmem.nfree[o]++;
+}
+
+// オーダーoの空きリストからブロックを取り除く関数である。
+// kmem.lockを保持している必要がある。
+static void
+blk_remove(struct block *b, int o)
+{
+  b->prev->next = b->next;
+  b->next->prev = b->prev;
+  kmem.order[PAGEIDX(b)] = NOTFREE;
+  kmem.nfree[o]--;
+}
+
+// オーダーoのブロックを一つ割り当てる関数である。
+// 大きなブロックしか空いていない場合は半分ずつ分割し、余りを空きリストに戻す。
+// kmem.lockを保持している必要がある。空きがない場合は0を返す。
+static void*
+buddy_alloc(int o)
+{
+  struct block *b;
+  int k;
+
+  for(k = o; k <= MAXORDER; k++)
+    if(kmem.free[k].next != &kmem.free[k])
+      break;
+  if(k > MAXORDER)
+    return 0;
+
+  b = kmem.free[k].next;
+  blk_remove(b, k);
+  while(k > o){
+    k--;
+    blk_push((char*)b + BLKSIZE(k), k); // 後半をバディとして空きリストに戻す。
+  }
+  return (void*)b;
+}
+
+// オーダーoのブロックを解放する関数である。
+// バディが同じオーダーで空いている限り結合を繰り返す。
+// kmem.lockを保持している必要がある。
+static void
+buddy_free(void *pa, int o)
+{
+  uint64 buddy;
+
+  for(; o < MAXORDER; o++){
+    buddy = (uint64)pa ^ BLKSIZE(o);
+    if(buddy < (uint64)end || buddy + BLKSIZE(o) > PHYSTOP)
+      break;
+    if(kmem.order[PAGEIDX(buddy)] != o)
+      break;
+    blk_remove((struct block*)buddy, o);
+    if(buddy < (uint64)pa)
+      pa = (void*)buddy;
+  }
+  blk_push(pa, o);
 }
 
 // 指定された範囲の物理メモリを解放する関数である。
+// 範囲をアラインされた最大のブロックに分割してバディアロケータに渡す。
 void
 freerange(void *pa_start, void *pa_end)
 {
   char *p;
+  int o;
+
   p = (char*)PGROUNDUP((uint64)pa_start); // 開始アドレスをページ境界に切り上げる。
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p); // 各ページを解放する。
+  acquire(&kmem.lock);
+  while(p + PGSIZE <= (char*)pa_end){
+    for(o = MAXORDER; o > 0; o--)
+      if((uint64)p % BLKSIZE(o) == 0 && p + BLKSIZE(o) <= (char*)pa_end)
+        break;
+    buddy_free(p, o);
+    p += BLKSIZE(o);
+  }
+  release(&kmem.lock);
 }
 
-// 物理メモリのページを解放する関数である。
-// 通常、kalloc()の呼び出しによって返されたポインタを引数とする。
-// （例外は、アロケータの初期化時である。上記のkinitを参照。）
+// リスト*listの先頭から最大maxページを切り離して返す関数である。
+// 切り離したページ数を*nに、最後のページを*tailに設定する。
+// 呼び出し元はリストを保護するロックを保持している必要がある。
+static struct run*
+takepages(struct run **list, int max, int *n, struct run **tail)
+{
+  struct run *head, *r;
+  int i;
+
+  head = *list;
+  if(head == 0 || max <= 0){
+    *n = 0;
+    *tail = 0;
+    return 0;
+  }
+  r = head;
+  for(i = 1; i < max && r->next; i++)
+    r = r->next;
+  *list = r->next;
+  r->next = 0;
+  *n = i;
+  *tail = r;
+  return head;
+}
+
+// ページのリストをオーダー0のブロックとしてバディアロケータに戻す関数である。
+static void
+putpages(struct run *r)
+{
+  struct run *next;
+
+  acquire(&kmem.lock);
+  for(; r; r = next){
+    next = r->next;
+    buddy_free(r, 0);
+  }
+  release(&kmem.lock);
+}
+
+// 物理メモリのページの参照を一つ手放す関数である。
+// kalloc()の呼び出しによって返されたポインタを引数とする。
+// 参照カウントが0になったときにページを解放する。
 void
 kfree(void *pa)
 {
-  struct run *r;
+  struct run *r, *batch, *tail;
+  struct kcpu *kc;
+  int n, ref;
 
   // paがページアラインされているか、カーネル終了アドレスより小さいか、
   // 物理メモリの範囲外でないかをチェックする。
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  ref = __sync_sub_and_fetch(&kmem.ref[PAGEIDX(pa)], 1);
+  if(ref < 0)
+    panic("kfree: ref");
+  if(ref > 0)
+    return; // まだ他のページテーブルから参照されている。
+
   // ダングリング参照を捕まえるためにジャンクで埋める。
   memset(pa, 1, PGSIZE);
 
   r = (struct run*)pa;
 
+  // cpuid()を使う間、別のCPUへ移動しないように割り込みを無効にする。
+  push_off();
+  kc = &kmem.cpu[cpuid()];
+
+  acquire(&kc->lock);
+  r->next = kc->freelist; // ローカルリストの先頭に追加する。
+  kc->freelist = r;
+  kc->nfree++;
+  batch = 0;
+  if(kc->nfree > 2*KBATCH){
+    // ローカルリストが大きくなりすぎたので、一部をバディアロケータに戻す。
+    batch = takepages(&kc->freelist, KBATCH, &n, &tail);
+    kc->nfree -= n;
+  }
+  release(&kc->lock);
+
+  if(batch)
+    putpages(batch);
+  pop_off();
+}
+
+// ローカルリストが空のときに呼ばれ、補充用のページのリストを返す関数である。
+// バディアロケータから最大KBATCHページを取り出し、それも空であれば
+// 他のCPUの空きリストから半分を横取りする。
+// ロックを二つ同時に保持しないため、デッドロックは起こらない。
+static struct run*
+refill(int id)
+{
+  struct run *batch, *r, *tail;
+  struct kcpu *kc;
+  int n;
+
+  batch = 0;
   acquire(&kmem.lock);
-  r->next = kmem.freelist; // 解放リストの先頭に追加する。
-  kmem.freelist = r;
+  for(n = 0; n < KBATCH && (r = buddy_alloc(0)) != 0; n++){
+    r->next = batch;
+    batch = r;
+  }
   release(&kmem.lock);
+  if(batch)
+    return batch;
+
+  for(int i = 1; i < NCPU; i++){
+    kc = &kmem.cpu[(id + i) % NCPU];
+    acquire(&kc->lock);
+    batch = takepages(&kc->freelist, (kc->nfree + 1) / 2, &n, &tail);
+    kc->nfree -= n;
+    release(&kc->lock);
+    if(batch)
+      return batch;
+  }
+  return 0;
 }
 
 // 4096バイトの物理メモリのページを1つ割り当てる関数である。
@@ -71,15 +299,191 @@ kfree(void *pa)
 void *
 kalloc(void)
 {
-  struct run *r;
+  struct run *r, *batch, *next;
+  struct kcpu *kc;
+  int id;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist; // 解放リストの先頭からページを取得する。
-  if(r)
-    kmem.freelist = r->next; // リストを更新する。
-  release(&kmem.lock);
+  push_off();
+  id = cpuid();
+  kc = &kmem.cpu[id];
 
-  if(r)
+  acquire(&kc->lock);
+  r = kc->freelist; // ローカルリストの先頭からページを取得する。
+  if(r){
+    kc->freelist = r->next; // リストを更新する。
+    kc->nfree--;
+  }
+  release(&kc->lock);
+
+  if(r == 0 && (batch = refill(id)) != 0){
+    // 先頭のページを返し、残りをローカルリストに移す。
+    r = batch;
+    acquire(&kc->lock);
+    for(batch = batch->next; batch; batch = next){
+      next = batch->next;
+      batch->next = kc->freelist;
+      kc->freelist = batch;
+      kc->nfree++;
+    }
+    release(&kc->lock);
+  }
+  pop_off();
+
+  if(r){
     memset((char*)r, 5, PGSIZE); // ジャンクで埋める。
+    kmem.ref[PAGEIDX(r)] = 1;
+  }
   return (void*)r;
 }
+
+// kalloc()と同じくページを1つ割り当てる関数である。
+// メモリが足りなければバッファキャッシュを縮小してやり直す。
+// bshrink()はバッファキャッシュのスピンロックを取るので、
+// スピンロックを保持していない（眠ってもよい）呼び出し元だけが使える。
+void *
+kalloc_reclaim(void)
+{
+  void *pa;
+
+  while((pa = kalloc()) == 0 && bshrink() > 0)
+    ;
+  return pa;
+}
+
+// kalloc()で割り当てたページの参照カウントを増加させる関数である。
+void
+krefinc(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("krefinc");
+  if(__sync_fetch_and_add(&kmem.ref[PAGEIDX(pa)], 1) < 1)
+    panic("krefinc: free page");
+}
+
+// kalloc()で割り当てたページの参照カウントを返す関数である。
+int
+krefcnt(void *pa)
+{
+  return __sync_fetch_and_add(&kmem.ref[PAGEIDX(pa)], 0);
+}
+
+// すべてのCPUの空きリストをバディアロケータに戻す関数である。
+// ローカルリストに残ったページが大きなブロックへの結合を妨げている場合に使う。
+static void
+kdrain(void)
+{
+  struct run *batch;
+  struct kcpu *kc;
+
+  for(int i = 0; i < NCPU; i++){
+    kc = &kmem.cpu[i];
+    acquire(&kc->lock);
+    batch = kc->freelist;
+    kc->freelist = 0;
+    kc->nfree = 0;
+    release(&kc->lock);
+    putpages(batch);
+  }
+}
+
+// 2^orderページの物理的に連続した領域を割り当てる関数である。
+// 返されるアドレスはPGSIZE << orderにアラインされている。
+// メモリが割り当てられない場合は0を返す。
+void *
+kalloc_order(int order)
+{
+  void *pa;
+
+  if(order < 0 || order > MAXORDER)
+    return 0;
+  if(order == 0)
+    return kalloc();
+
+  acquire(&kmem.lock);
+  pa = buddy_alloc(order);
+  release(&kmem.lock);
+  if(pa == 0){
+    kdrain();
+    acquire(&kmem.lock);
+    pa = buddy_alloc(order);
+    release(&kmem.lock);
+  }
+
+  if(pa)
+    memset(pa, 5, BLKSIZE(order)); // ジャンクで埋める。
+  return pa;
+}
+
+// kalloc_order(order)で割り当てた領域を解放する関数である。
+void
+kfree_order(void *pa, int order)
+{
+  if(order == 0){
+    kfree(pa);
+    return;
+  }
+
+  if(order < 0 || order > MAXORDER || ((uint64)pa % BLKSIZE(order)) != 0 ||
+     (char*)pa < end || (uint64)pa + BLKSIZE(order) > PHYSTOP)
+    panic("kfree_order");
+
+  // ダングリング参照を捕まえるためにジャンクで埋める。
+  memset(pa, 1, BLKSIZE(order));
+
+  acquire(&kmem.lock);
+  buddy_free(pa, order);
+  release(&kmem.lock);
+}
+
+// バディアロケータ内のオーダーorderの空きブロック数を返す関数である。
+// CPUごとの空きリストにあるページは含まない。
+int
+kalloc_nfree(int order)
+{
+  int n;
+
+  if(order < 0 || order > MAXORDER)
+    return 0;
+  acquire(&kmem.lock);
+  n = kmem.nfree[order];
+  release(&kmem.lock);
+  return n;
+}
+
+// 起動時にバディアロケータを確かめる関数である。kinit()から一度だけ呼ばれる。
+// いろいろなオーダーの領域を割り当ててアラインメントと重なりを調べ、
+// 割り当てとは異なる順に解放したあと、バディが結合されて
+// オーダーごとの空きブロック数が元に戻ることを確かめる。
+static void
+kcheck(void)
+{
+  static int order[] = { 0, 2, 1, MAXORDER, 0, 3, 1, 2, MAXORDER-1, 0 };
+  enum { N = sizeof(order) / sizeof(order[0]) };
+  int nfree[MAXORDER+1];
+  char *pa[N];
+  int i, j, o;
+
+  for(o = 0; o <= MAXORDER; o++)
+    nfree[o] = kalloc_nfree(o);
+
+  for(i = 0; i < N; i++){
+    if((pa[i] = kalloc_order(order[i])) == 0)
+      panic("kcheck: alloc");
+    if((uint64)pa[i] % BLKSIZE(order[i]) != 0)
+      panic("kcheck: align");
+    for(j = 0; j < i; j++)
+      if(pa[i] < pa[j] + BLKSIZE(order[j]) && pa[j] < pa[i] + BLKSIZE(order[i]))
+        panic("kcheck: overlap");
+  }
+
+  // 奇数番目を先に、偶数番目を後から解放して、結合の順序を入れ替える。
+  for(i = 1; i < N; i += 2)
+    kfree_order(pa[i], order[i]);
+  for(i = 0; i < N; i += 2)
+    kfree_order(pa[i], order[i]);
+  kdrain();
+
+  for(o = 0; o <= MAXORDER; o++)
+    if(kalloc_nfree(o) != nfree[o])
+      panic("kcheck: coalesce");
+}
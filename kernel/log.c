@@ -6,44 +6,117 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "proc.h"
 
 // シンプルなログ機構であり、複数のFSシステムコールの同時実行を許可する。
 //
 // ログトランザクションは複数のFSシステムコールの更新を含む。
-// ログシステムは、アクティブなFSシステムコールがない場合にのみコミットする。
-// したがって、コミットが未コミットのシステムコールの更新をディスクに書き込むかどうか
-// を考慮する必要はない。
+// ログシステムは、開いているトランザクションにアクティブなFSシステムコールがない場合にのみ
+// そのトランザクションを閉じてコミットする。したがって、コミットが未コミットのシステムコールの
+// 更新をディスクに書き込むかどうかを考慮する必要はない。
+//
+// メモリ上には2つのトランザクションがある。1つは新しい操作を受け付ける開いたトランザクション
+// (log.lh)で、もう1つはディスクに書き込み中のトランザクション(log.clh)である。
+// コミットは、閉じたトランザクションのブロックをログブロックのバッファに写し取ってから
+// 新しい操作を再び受け付けるので、ログへの書き込みの間も
+// 次のトランザクションに操作が集まる（グループコミット）。
+// コミット中に閉じる準備ができたトランザクションは、コミットしているプロセスが続けてコミットする。
 //
 // システムコールはbegin_op()/end_op()を呼び出して開始と終了をマークする必要がある。
-// 通常、begin_op()は進行中のFSシステムコールのカウントをインクリメントして戻るだけである。
-// しかし、ログがすぐにいっぱいになると判断した場合は、最後のend_op()がコミットするまで
-// スリープする。
+// begin_op()は書き込むかもしれないブロック数をトランザクションに予約する。既定の予約は
+// mkfsがスーパーブロックに記録したmaxopで、書き込む量がわかっている操作はbegin_opn()で
+// 必要な分だけ予約する。トランザクションの大きさもスーパーブロックのnlogtransで決まる。
+// 通常、begin_op()は予約を加えて戻るだけである。
+// しかし、ログがすぐにいっぱいになると判断した場合は、トランザクションが閉じるまでスリープする。
+// end_op()はコミットを待たずに戻ることがある。永続化を待つにはlog_sync()を使う。
 //
-// ログはディスクブロックを含む物理リドゥログである。
+// ログはディスクブロックを含む物理リドゥログで、循環バッファとして使う。
 // ディスク上のログフォーマット:
-//   ヘッダーブロックには、ブロックA、B、Cのブロック番号が含まれる。
-//   ブロックA
-//   ブロックB
-//   ブロックC
-//   ...
-// ログの追加は同期的である。
-
-// ヘッダーブロックの内容であり、ディスク上のヘッダーブロックと
-// コミット前にメモリ内で記録するログブロック番号を追跡するために使用される。
+//   ヘッダーブロックには、チェックポイントが済んでいない最も古いトランザクションの位置と
+//   通し番号が含まれる。
+//   それ以降のブロックにトランザクションを順に追記し、末尾に達したら先頭に戻る。
+//   1つのトランザクションは次のブロックからなる:
+//     記述子ブロック（通し番号と、ブロックA、B、Cのブロック番号）
+//     ブロックA
+//     ブロックB
+//     ブロックC
+//     コミットブロック（通し番号）
+// コミットブロックの書き込みがトランザクションのコミットである。
+// コミットしたブロックはすぐにはホームロケーションに書き込まず、キャッシュにピン留めしておく。
+// ログの空きが少なくなったら、ログにあるすべてのトランザクションをまとめてチェックポイントする。
+// 複数のトランザクションが書き換えたブロックは、最後の内容を一度だけ書き込む。
+// 回復時は、ヘッダーの位置から通し番号の続くコミット済みのトランザクションを順に再生する。
+
+#define LOGMAGIC 0x6c6f6731  // 記述子ブロックとコミットブロックのマジック値
+
+// ヘッダーブロックの内容である。
 struct logheader {
+  int tail; // チェックポイントが済んでいない最も古いトランザクションの位置
+  int seq;  // その通し番号
+};
+
+// 記述子ブロックの内容である。
+struct logdesc {
+  uint magic;
+  int seq;
   int n;
   int block[LOGSIZE];
 };
 
+// コミットブロックの内容である。
+struct logcommit {
+  uint magic;
+  int seq;
+};
+
+// メモリ内で記録するトランザクションのブロック番号である。
+struct logtrans {
+  int n;
+  int block[LOGSIZE];
+};
+
+// トランザクションが解放したデータブロックの記録である。
+// コミットされるまでは、解放前のファイルがクラッシュ後に残りうるので、
+// 再利用したブロックをログを通さずに書き込んではならない。
+// 記録しきれなければoverflowを立て、その間はすべてのブロックを同じように扱う。
+#define NLOGFREE 128
+struct logfree {
+  int n;
+  int overflow;
+  uint block[NLOGFREE];
+};
+
 // ログの構造体である。
 struct log {
   struct spinlock lock;
   int start;
   int size;
-  int outstanding; // 実行中のFSシステムコールの数。
-  int committing;  // commit()中であることを示し、待機するよう指示する。
+  int cap;         // 循環バッファとして使うブロック数（ヘッダーブロックを除く）。
+  int trans;       // 1つのトランザクションの最大ブロック数。
+  int maxop;       // begin_op()が予約するブロック数。
+  int outstanding; // 開いているトランザクションで実行中のFSシステムコールの数。
+  int reserved;    // 実行中のFSシステムコールが予約したブロック数の合計。
+  int committing;  // commit()中であることを示す。
+  int copying;     // コミットするブロックを写し取っている間、新しい操作を待たせる。
+  int seq;         // 開いているトランザクションの通し番号。
+  int done;        // コミットが完了した最後のトランザクションの通し番号。
+  int tail;        // チェックポイントが済んでいない最も古いトランザクションの位置。
+  int head;        // 次のトランザクションを書き込む位置。
+  int used;        // tailからheadまでのブロック数。
   int dev;
-  struct logheader lh;
+  struct logtrans lh;   // 開いているトランザクション
+  struct logtrans clh;  // コミット中のトランザクション
+  struct logfree lf;    // 開いているトランザクションが解放したブロック
+  struct logfree clf;   // コミット中のトランザクションが解放したブロック
+  struct buf *to[LOGSIZE];    // clhのブロックを写し取ったログブロック
+  struct buf *home[LOGSIZE];  // clhのブロックのキャッシュ上のバッファ（ピン留めされている）
+  // ログの各位置に記録したブロックのブロック番号とキャッシュ上のバッファ。
+  // 記述子ブロックとコミットブロックの位置ではblocknoが-1である。
+  struct {
+    int blockno;
+    struct buf *b;
+  } slot[LOGBLOCKS];
+  struct buf shadow[LOGSIZE]; // ホームロケーションに書き込むための、キャッシュにないバッファ
 };
 struct log log;
 
@@ -53,94 +126,272 @@ static void commit();
 void
 initlog(int dev, struct superblock *sb)
 {
-  if (sizeof(struct logheader) >= BSIZE)
+  if (sizeof(struct logdesc) >= BSIZE)
     panic("initlog: too big logheader");
+  if (sb->nlog > LOGBLOCKS || sb->nlogtrans > LOGSIZE || sb->nlogtrans + 3 > sb->nlog ||
+      sb->maxop < 1 || sb->maxop > sb->nlogtrans)
+    panic("initlog: bad log size");
 
   initlock(&log.lock, "log");
+  for (int i = 0; i < LOGSIZE; i++)
+    initsleeplock(&log.shadow[i].lock, "log shadow");
   log.start = sb->logstart;
   log.size = sb->nlog;
+  log.cap = log.size - 1;
+  log.trans = sb->nlogtrans;
+  log.maxop = sb->maxop;
   log.dev = dev;
   recover_from_log();
 }
 
-// コミットされたブロックをログからホームロケーションにコピーする
-static void
-install_trans(int recovering)
+// ログの位置posのブロック番号を返す。
+static int
+logblock(int pos)
 {
-  int tail;
-
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // ログブロックを読み込む
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // 目的地ブロックを読み込む
-    memmove(dbuf->data, lbuf->data, BSIZE);  // ブロックを目的地にコピーする
-    bwrite(dbuf);  // 目的地ブロックをディスクに書き込む
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
-  }
+  return log.start + 1 + pos % log.cap;
 }
 
-// ログヘッダーをディスクからメモリ内のログヘッダーに読み込む
+// ログヘッダーをディスクから読み込む
 static void
-read_head(void)
+read_head(struct logheader *h)
 {
   struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *) (buf->data);
-  int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
-  }
+  *h = *(struct logheader *) (buf->data);
   brelse(buf);
 }
 
-// メモリ内のログヘッダーをディスクに書き込む。
-// これが現在のトランザクションがコミットされる真のポイントである。
+// ログヘッダーをディスクに書き込む。
+// tailより前のトランザクションはログから消去される。
 static void
-write_head(void)
+write_head(int tail, int seq)
 {
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *hb = (struct logheader *) (buf->data);
-  int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
-  }
+  hb->tail = tail;
+  hb->seq = seq;
   bwrite(buf);
   brelse(buf);
 }
 
+// 位置posにある通し番号seqのトランザクションがコミットされていれば、
+// そのブロック番号をtに読み込んで1を返す。そうでなければ0を返す。
+static int
+read_trans(int pos, int seq, struct logtrans *t)
+{
+  struct buf *buf;
+  struct logdesc *d;
+  struct logcommit *c;
+  int ok;
+
+  buf = bread(log.dev, logblock(pos));
+  d = (struct logdesc *) (buf->data);
+  ok = d->magic == LOGMAGIC && d->seq == seq && d->n > 0 && d->n <= log.trans;
+  if (ok) {
+    t->n = d->n;
+    memmove(t->block, d->block, t->n * sizeof(t->block[0]));
+  }
+  brelse(buf);
+  if (!ok)
+    return 0;
+
+  buf = bread(log.dev, logblock(pos + 1 + t->n));
+  c = (struct logcommit *) (buf->data);
+  ok = c->magic == LOGMAGIC && c->seq == seq;
+  brelse(buf);
+  return ok;
+}
+
+// 回復時に、位置posにあるトランザクションtのブロックをログからホームロケーションにコピーする
+// すべての目的地ブロックの書き込みをまとめて発行してから完了を待つ。
+static void
+install_trans(int pos, struct logtrans *t)
+{
+  struct buf *dbuf[LOGSIZE];
+  int i;
+
+  for (i = 0; i < t->n; i++) {
+    struct buf *lbuf = bread(log.dev, logblock(pos+1+i)); // ログブロックを読み込む
+    dbuf[i] = bread(log.dev, t->block[i]); // 目的地ブロックを読み込む
+    memmove(dbuf[i]->data, lbuf->data, BSIZE);  // ブロックを目的地にコピーする
+    brelse(lbuf);
+  }
+  bwritev(dbuf, t->n);  // 目的地ブロックをディスクに書き込む
+  for (i = 0; i < t->n; i++)
+    brelse(dbuf[i]);
+}
+
 static void
 recover_from_log(void)
 {
-  read_head();
-  install_trans(1); // コミットされている場合、ログからディスクにコピーする
-  log.lh.n = 0;
-  write_head(); // ログをクリアする
+  struct logheader h;
+  struct logtrans t;
+  int pos, seq;
+
+  read_head(&h);
+  pos = h.tail % log.cap;
+  seq = h.seq;
+  // コミットされているトランザクションを順にログからディスクにコピーする
+  while (read_trans(pos, seq, &t)) {
+    install_trans(pos, &t);
+    pos = (pos + t.n + 2) % log.cap;
+    seq++;
+  }
+  write_head(pos, seq); // ログをクリアする
+
+  log.tail = log.head = pos;
+  log.used = 0;
+  log.seq = seq;
+  log.done = seq - 1;
+}
+
+// ログにあるすべてのトランザクションのブロックをホームロケーションに書き込み、ログを空にする。
+// 同じブロックが複数のトランザクションにあれば、最も新しい内容だけを書き込む。
+// キャッシュ上のバッファは開いているトランザクションがすでに変更しているかもしれないので、
+// ログブロックのデータを指すキャッシュにないバッファを使って書き込む。
+// log.committingを設定したプロセスから呼ばれる。
+static void
+checkpoint(void)
+{
+  static int pos[LOGBLOCKS];
+  struct buf *lbuf[LOGSIZE], *w[LOGSIZE];
+  int i, j, k, n, p, seq;
+
+  if (log.used == 0)
+    return;
+
+  // 新しい位置から古い位置へたどり、各ブロックの最も新しい位置を集める。
+  n = 0;
+  for (i = log.used - 1; i >= 0; i--) {
+    p = (log.tail + i) % log.cap;
+    if (log.slot[p].blockno < 0)
+      continue;
+    for (j = 0; j < n; j++)
+      if (log.slot[pos[j]].blockno == log.slot[p].blockno)
+        break;
+    if (j == n)
+      pos[n++] = p;
+  }
+
+  for (i = 0; i < n; i += k) {
+    for (k = 0; k < LOGSIZE && i + k < n; k++) {
+      struct buf *b = &log.shadow[k];
+      lbuf[k] = bread(log.dev, logblock(pos[i+k]));
+      acquiresleep(&b->lock);
+      b->dev = log.dev;
+      b->blockno = log.slot[pos[i+k]].blockno;
+      b->data = lbuf[k]->data;
+      w[k] = b;
+    }
+    bwritev(w, k);
+    for (j = 0; j < k; j++) {
+      log.shadow[j].data = 0;
+      releasesleep(&log.shadow[j].lock);
+      brelse(lbuf[j]);
+    }
+  }
+
+  // 次にコミットするトランザクションの位置と通し番号をヘッダーに書き込み、ログを空にする。
+  acquire(&log.lock);
+  seq = log.seq;
+  release(&log.lock);
+  write_head(log.head, seq);
+
+  // log_logged()が見るので、log.lockを保持して変更する。
+  acquire(&log.lock);
+  for (i = 0; i < log.used; i++) {
+    p = (log.tail + i) % log.cap;
+    if (log.slot[p].blockno >= 0)
+      bunpin(log.slot[p].b);
+    log.slot[p].blockno = -1;
+    log.slot[p].b = 0;
+  }
+  log.tail = log.head;
+  log.used = 0;
+  release(&log.lock);
 }
 
 // 各FSシステムコールの開始時に呼び出される関数である。
+// 最大nブロックを書き込む操作として、トランザクションにnブロックを予約する。
 void
-begin_op(void)
+begin_opn(int n)
 {
+  struct proc *p = myproc();
+
+  if(n < 1 || n > log.trans)
+    panic("begin_opn");
+
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.copying){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    } else if(log.lh.n + log.reserved + n > log.trans){
       // この操作がログスペースを使い果たす可能性があるため、コミットを待つ。
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
+      log.reserved += n;
+      p->logres = n;
       release(&log.lock);
       break;
     }
   }
 }
 
+// 既定の数のブロックを予約してFSシステムコールを開始する関数である。
+void
+begin_op(void)
+{
+  begin_opn(log.maxop);
+}
+
+// 開いているトランザクションでブロックblocknoを解放したことを記録する。bfree()から呼ばれる。
+void
+log_free(uint blockno)
+{
+  acquire(&log.lock);
+  if (log.lf.n < NLOGFREE)
+    log.lf.block[log.lf.n++] = blockno;
+  else
+    log.lf.overflow = 1;
+  release(&log.lock);
+}
+
+// ブロックblocknoが開いているトランザクション、コミット中のトランザクション、
+// またはチェックポイント前のログにあるか、まだコミットされていないトランザクションが
+// 解放したブロックであれば1を返す。
+// writei()が、ログにある古い内容で上書きされるおそれのあるブロックや、クラッシュ後に
+// 解放前のファイルに戻るおそれのあるブロックを、ログを通さずに書かないために使う。
+int
+log_logged(uint blockno)
+{
+  int i, r = 0;
+
+  acquire(&log.lock);
+  r = log.lf.overflow || log.clf.overflow;
+  for (i = 0; i < log.lf.n && !r; i++)
+    r = log.lf.block[i] == blockno;
+  for (i = 0; i < log.clf.n && !r; i++)
+    r = log.clf.block[i] == blockno;
+  for (i = 0; i < log.lh.n && !r; i++)
+    r = log.lh.block[i] == blockno;
+  for (i = 0; i < log.clh.n && !r; i++)
+    r = log.clh.block[i] == blockno;
+  for (i = 0; i < log.used && !r; i++)
+    r = log.slot[(log.tail + i) % log.cap].blockno == blockno;
+  release(&log.lock);
+  return r;
+}
+
+// 1つのFS操作が予約できる最大のブロック数を返す。
+int
+log_opmax(void)
+{
+  return log.trans;
+}
+
 // 各FSシステムコールの終了時に呼び出される関数である。
-// これが最後の未完了の操作であればコミットする。
+// これが最後の未完了の操作で、ほかにコミット中のトランザクションがなければコミットする。
+// コミット中であれば、コミットしているプロセスがこのトランザクションも続けてコミットする。
 void
 end_op(void)
 {
@@ -148,14 +399,14 @@ end_op(void)
 
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
+  log.reserved -= myproc()->logres;
+  myproc()->logres = 0;
+  if(log.outstanding == 0 && log.committing == 0 && log.lh.n > 0){
     do_commit = 1;
     log.committing = 1;
   } else {
     // begin_op()がログスペースを待機している可能性があるため、
-    // log.outstandingをデクリメントすると予約済みスペースが減少する。
+    // log.reservedを減らすと予約済みスペースが減少する。
     wakeup(&log);
   }
   release(&log.lock);
@@ -163,44 +414,157 @@ end_op(void)
   if(do_commit){
     // ロックを保持せずにコミットを呼び出す。ロックを保持したままスリープすることは許可されていないため。
     commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
   }
 }
 
-// キャッシュからログに修正されたブロックをコピーする。
+// これまでに終わったFSシステムコールの更新がすべてディスクにコミットされるまで待つ。
+void
+log_sync(void)
+{
+  int seq;
+
+  acquire(&log.lock);
+  // 開いているトランザクションに更新があればそれを、なければコミット中のものを待つ。
+  seq = log.lh.n > 0 ? log.seq : log.seq - 1;
+  while(log.done < seq)
+    sleep(&log, &log.lock);
+  release(&log.lock);
+}
+
+// キャッシュからログブロックに修正されたブロックを写し取る。
+// ログブロックは記述子ブロックの次の位置から並べる。
+// この間は新しい操作を受け付けないので、写し取ったデータはclhの操作の結果だけを含む。
+// ログブロックは全体を上書きするので、bnew()でディスクから読まずに用意する。
 static void
-write_log(void)
+copy_log(void)
 {
   int tail;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // ログブロック
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // キャッシュブロック
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // ログに書き込む
+  for (tail = 0; tail < log.clh.n; tail++) {
+    log.to[tail] = bnew(log.dev, logblock(log.head+1+tail)); // ログブロック
+    struct buf *from = bread(log.dev, log.clh.block[tail]); // キャッシュブロック
+    memmove(log.to[tail]->data, from->data, BSIZE);
+    log.home[tail] = from; // ピン留めされているので、解放してもキャッシュに残る
     brelse(from);
-    brelse(to);
   }
 }
 
+// 記述子ブロックと写し取ったログブロックをログに書き込む。
+// すべての書き込みをまとめて発行してから完了を待つ。
+// 記述子ブロックは全体を書き直すので、ディスクから読まない。
+static void
+write_log(int seq)
+{
+  struct buf *w[LOGSIZE+1];
+  struct buf *buf = bnew(log.dev, logblock(log.head));
+  struct logdesc *d = (struct logdesc *) (buf->data);
+
+  memset(buf->data, 0, BSIZE);
+  d->magic = LOGMAGIC;
+  d->seq = seq;
+  d->n = log.clh.n;
+  memmove(d->block, log.clh.block, log.clh.n * sizeof(d->block[0]));
+
+  // bwritev()はw[]を並べ替えるので、log.to[]の順序を保つためにコピーを渡す。
+  w[0] = buf;
+  memmove(w+1, log.to, log.clh.n * sizeof(w[0]));
+  bwritev(w, log.clh.n + 1);  // ログに書き込む
+  brelse(buf);
+}
+
+// コミットブロックを書き込む。これが現在のトランザクションがコミットされる真のポイントである。
+// 記述子ブロックと同じく、ディスクから読まずに全体を書き直す。
+static void
+write_commit(int seq)
+{
+  struct buf *buf = bnew(log.dev, logblock(log.head + 1 + log.clh.n));
+  struct logcommit *c = (struct logcommit *) (buf->data);
+
+  memset(buf->data, 0, BSIZE);
+  c->magic = LOGMAGIC;
+  c->seq = seq;
+  bwrite(buf);
+  brelse(buf);
+}
+
+// log.committingを設定したプロセスから呼ばれ、閉じることのできるトランザクションがなくなるまで
+// コミットを続ける。その後、ログの半分以上が使われていればチェックポイントする。
+// チェックポイントの間に終わった操作はcommittingを見てコミットしないので、
+// その後もう一度確かめてから、log.lockを保持したままcommittingを下ろす。
 static void
 commit()
 {
-  if (log.lh.n > 0) {
-    write_log();     // キャッシュからログに修正されたブロックを書き込む
-    write_head();    // ヘッダーをディスクに書き込む - 実際のコミット
-    install_trans(0); // 書き込みをホームロケーションにインストールする
+  int seq, n, tail;
+
+  acquire(&log.lock);
+  while(1){
+    if(log.lh.n == 0 || log.outstanding > 0){
+      if(log.used <= log.cap / 2)
+        break;
+      // 次のコミットがチェックポイントを待たずに済むように、ログが半分埋まったら先に済ませておく。
+      release(&log.lock);
+      checkpoint();
+      acquire(&log.lock);
+      continue;
+    }
+    if(log.lh.n + 2 > log.cap - log.used){
+      // ログに空きがないので、チェックポイントしてから改めて確かめる。
+      release(&log.lock);
+      checkpoint();
+      acquire(&log.lock);
+      continue;
+    }
+
+    // 開いているトランザクションを閉じ、新しいトランザクションを開く。
+    log.clh = log.lh;
     log.lh.n = 0;
-    write_head();    // トランザクションをログから消去する
+    log.clf = log.lf;
+    log.lf.n = 0;
+    log.lf.overflow = 0;
+    n = log.clh.n;
+    seq = log.seq++;
+    log.copying = 1;
+    release(&log.lock);
+
+    copy_log();
+
+    acquire(&log.lock);
+    log.copying = 0;
+    wakeup(&log);
+    release(&log.lock);
+
+    write_log(seq);    // 記述子ブロックと写し取ったブロックをログに書き込む
+    write_commit(seq); // コミットブロックをディスクに書き込む - 実際のコミット
+
+    for (tail = 0; tail < n; tail++)
+      brelse(log.to[tail]);
+
+    // ブロックはチェックポイントまでピン留めしたままにする。
+    // log_logged()が見るので、log.lockを保持して記録する。
+    acquire(&log.lock);
+    log.slot[log.head].blockno = -1;
+    for (tail = 0; tail < n; tail++) {
+      int p = (log.head + 1 + tail) % log.cap;
+      log.slot[p].blockno = log.clh.block[tail];
+      log.slot[p].b = log.home[tail];
+    }
+    log.slot[(log.head + 1 + n) % log.cap].blockno = -1;
+    log.head = (log.head + n + 2) % log.cap;
+    log.used += n + 2;
+    log.clh.n = 0;
+    log.clf.n = 0;  // 解放はコミットされたので、ブロックは直接書き込んでよい。
+    log.clf.overflow = 0;
+    log.done = seq;
+    wakeup(&log);
   }
+  log.committing = 0;
+  wakeup(&log);
+  release(&log.lock);
 }
 
 // 呼び出し元がb->dataを修正し、バッファの使用を終了したことを示す。
 // ブロック番号を記録し、refcntを増加させることでキャッシュにピン留めする。
-// commit()/write_log()はディスクへの書き込みを行う。
+// commit()/write_log()はログへの書き込みを行い、checkpoint()がピン留めを解除する。
 //
 // log_write()はbwrite()の代わりに使用される。典型的な使用例は以下の通り:
 //   bp = bread(...)
@@ -213,7 +577,7 @@ log_write(struct buf *b)
   int i;
 
   acquire(&log.lock);
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  if (log.lh.n >= log.trans)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
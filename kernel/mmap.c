@@ -0,0 +1,284 @@
+//
+// mmap()とmunmap()によるファイルと匿名メモリのマッピングである。
+// 各プロセスはマッピングをp->vma[]に記録し、ページは最初にアクセスされたときに
+// uvmfault()からmmapload()が用意する。
+// マッピングはTRAPFRAMEの下から低いアドレスに向かって配置し、ヒープはその下までしか伸ばせない。
+// MAP_SHAREDの書き込み可能なファイルマッピングは、munmap()、exec()、exit()のときに
+// 変更されたページをログを通してファイルに書き戻す。
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "memlayout.h"
+#include "defs.h"
+#include "param.h"
+#include "fs.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "fcntl.h"
+#include "proc.h"
+
+// 空いているVMAを返す。なければ0を返す。
+static struct vma*
+vmaalloc(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->used == 0)
+      return v;
+  return 0;
+}
+
+// 仮想アドレスvaを含むマッピングを返す。なければ0を返す。
+struct vma*
+findvma(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->used && va >= v->addr && va < v->addr + v->len)
+      return v;
+  return 0;
+}
+
+// マッピングに使われている最も低いアドレスを返す。
+// ヒープはここまで、新しいマッピングはここから下に配置する。
+uint64
+mmapbase(struct proc *p)
+{
+  struct vma *v;
+  uint64 base = TRAPFRAME;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->used && v->addr < base)
+      base = v->addr;
+  return base;
+}
+
+// ファイルfのオフセットoffからlenバイトを現在のプロセスにマッピングし、その先頭アドレスを返す。
+// fが0なら匿名マッピングとしてゼロで埋めたページを用意する。
+// ページはここでは割り当てず、アクセスされたときにフォルトで用意する。
+// 失敗した場合は-1を返す。
+uint64
+mmap(struct file *f, uint64 len, int prot, int flags, uint off)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  uint64 base;
+  int share = flags & (MAP_SHARED | MAP_PRIVATE);
+
+  if(len == 0 || len > TRAPFRAME || off % PGSIZE != 0)
+    return -1;
+  if(share != MAP_SHARED && share != MAP_PRIVATE)
+    return -1;
+  if(f){
+    if(f->type != FD_INODE || f->readable == 0)
+      return -1;
+    // 書き戻せないファイルを共有して書き込むことはできない。
+    if((flags & MAP_SHARED) && (prot & PROT_WRITE) && f->writable == 0)
+      return -1;
+  }
+
+  len = PGROUNDUP(len);
+  base = mmapbase(p);
+  if(len > base || base - len < PGROUNDUP(p->sz))
+    return -1;
+  if((v = vmaalloc(p)) == 0)
+    return -1;
+
+  v->used = 1;
+  v->addr = base - len;
+  v->len = len;
+  v->prot = prot;
+  v->flags = flags;
+  v->off = off;
+  v->f = f ? filedup(f) : 0;
+  return v->addr;
+}
+
+// マッピングvのページとして、仮想アドレスvaを含む1ページ分をmemに読み込む。
+// memはゼロで埋められている必要があり、ファイルの末尾を越える部分はゼロのまま残る。
+// loadseg()と同じく、ファイルを読むために眠るのでスピンロックを保持したまま呼んではならない。
+// 成功時は0を返し、失敗時は-1を返す。
+int
+mmapload(struct vma *v, uint64 va, char *mem)
+{
+  if(v->f == 0)
+    return 0; // 匿名マッピング
+
+  ilock(v->f->ip);
+  if(readi(v->f->ip, 0, (uint64)mem, v->off + (PGROUNDDOWN(va) - v->addr), PGSIZE) < 0){
+    iunlock(v->f->ip);
+    return -1;
+  }
+  iunlock(v->f->ip);
+  return 0;
+}
+
+// マッピングvのうち[start, end)の変更されたページをファイルに書き戻す。
+// filewrite()と同じく、1回のトランザクションがログの大きさを超えないように分割する。
+// ファイルの末尾を越える部分は書き戻さず、ファイルを伸ばすことはない。
+static void
+writeback(struct proc *p, struct vma *v, uint64 start, uint64 end)
+{
+  int max = ((log_opmax()-1-1-2) / 2) * BSIZE;
+  struct inode *ip = v->f->ip;
+  uint64 a, pa;
+  uint off, i, n;
+  pte_t *pte;
+  int r;
+
+  for(a = start; a < end; a += PGSIZE){
+    pte = walk(p->pagetable, a, 0);
+    if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_D) == 0)
+      continue; // まだアクセスされていないか、変更されていないページ
+    pa = PTE2PA(*pte);
+    off = v->off + (a - v->addr);
+    for(i = 0; i < PGSIZE; i += r){
+      n = PGSIZE - i;
+      if(n > max)
+        n = max;
+
+      begin_opn((n + BSIZE - 1) / BSIZE * 2 + 1 + 1 + 2);
+      ilock(ip);
+      r = 0;
+      if(off + i < ip->size){
+        if(n > ip->size - (off + i))
+          n = ip->size - (off + i);
+        r = writei(ip, 0, pa + i, off + i, n);
+      }
+      iunlock(ip);
+      end_op();
+
+      if(r <= 0)
+        break; // ファイルの末尾に達したか、writei()のエラー
+    }
+  }
+}
+
+// プロセスpの[addr, addr+len)のマッピングを解除する。
+// 範囲が一部だけ重なるマッピングは縮め、マッピングの中ほどを解除したときは2つに分ける。
+// 成功時は0を返し、引数が不正か分割のためのVMAが足りない場合は-1を返す。
+int
+munmap(struct proc *p, uint64 addr, uint64 len)
+{
+  struct vma *v, *nv;
+  uint64 end, start, stop, vend;
+
+  if(addr % PGSIZE != 0 || len == 0 || len > TRAPFRAME)
+    return -1;
+  end = addr + PGROUNDUP(len);
+  if(end > TRAPFRAME)
+    return -1;
+
+  // マッピングは重ならないので、分割が必要になるのはたかだか1つである。
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->used && addr > v->addr && end < v->addr + v->len && vmaalloc(p) == 0)
+      return -1;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->used == 0)
+      continue;
+    vend = v->addr + v->len;
+    start = addr > v->addr ? addr : v->addr;
+    stop = end < vend ? end : vend;
+    if(start >= stop)
+      continue;
+
+    if(v->f && (v->flags & MAP_SHARED) && (v->prot & PROT_WRITE))
+      writeback(p, v, start, stop);
+    uvmunmap(p->pagetable, start, (stop - start) / PGSIZE, 1);
+
+    if(start == v->addr && stop == vend){
+      if(v->f)
+        fileclose(v->f);
+      v->used = 0;
+    } else if(start == v->addr){
+      v->off += stop - v->addr;
+      v->len = vend - stop;
+      v->addr = stop;
+    } else if(stop == vend){
+      v->len = start - v->addr;
+    } else {
+      nv = vmaalloc(p);
+      *nv = *v;
+      nv->addr = stop;
+      nv->len = vend - stop;
+      nv->off = v->off + (stop - v->addr);
+      if(nv->f)
+        filedup(nv->f);
+      v->len = start - v->addr;
+    }
+  }
+  return 0;
+}
+
+// プロセスpのすべてのマッピングを解除する。exec()とexit()から呼ばれる。
+void
+munmapall(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->used)
+      munmap(p, v->addr, v->len);
+}
+
+// fork()の前に、親プロセスpのMAP_SHAREDのマッピングのページをすべて用意する。
+// 親子で同じ物理ページを共有するためであり、ファイルを読むために眠ることがあるので
+// 子プロセスのロックを取る前に呼び出す。成功時は0を返し、メモリ不足の場合は-1を返す。
+int
+mmapprefork(struct proc *p)
+{
+  struct vma *v;
+  uint64 a;
+  pte_t *pte;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->used == 0 || (v->flags & MAP_SHARED) == 0 ||
+       (v->prot & (PROT_READ | PROT_WRITE | PROT_EXEC)) == 0)
+      continue;
+    for(a = v->addr; a < v->addr + v->len; a += PGSIZE){
+      pte = walk(p->pagetable, a, 0);
+      if((pte == 0 || (*pte & PTE_V) == 0) && uvmfault(p, a, 0) != 0)
+        return -1;
+    }
+  }
+  return 0;
+}
+
+// 親プロセスpのマッピングを子プロセスnpに引き継ぐ。
+// MAP_SHAREDのページは同じ物理ページを共有し、MAP_PRIVATEのページはコピーオンライトにする。
+// 成功時は0を返し、失敗時は子プロセスに作成したマッピングを解除して-1を返す。
+int
+mmapfork(struct proc *p, struct proc *np)
+{
+  struct vma *v;
+  int i;
+
+  for(i = 0; i < NVMA; i++){
+    v = &p->vma[i];
+    if(v->used == 0)
+      continue;
+    if(uvmcopyrange(p->pagetable, np->pagetable, v->addr, v->len,
+                    (v->flags & MAP_SHARED) == 0) < 0)
+      goto err;
+  }
+
+  for(i = 0; i < NVMA; i++){
+    np->vma[i] = p->vma[i];
+    if(np->vma[i].used && np->vma[i].f)
+      filedup(np->vma[i].f);
+  }
+  return 0;
+
+err:
+  while(--i >= 0){
+    v = &p->vma[i];
+    if(v->used)
+      uvmunmap(np->pagetable, v->addr, v->len / PGSIZE, 1);
+  }
+  return -1;
+}
@@ -2,12 +2,21 @@
 #define NCPU          8  // CPUの最大数
 #define NOFILE       16  // プロセスごとのオープンファイル数
 #define NFILE       100  // システム全体でのオープンファイル数
-#define NINODE       50  // アクティブなiノードの最大数
+#define NINODE     4096  // メモリ内に置くiノードの最大数（必要に応じてkallocのページから増やす）
+#define NDENTRY    1024  // ディレクトリエントリキャッシュのエントリ数
 #define NDEV         10  // メジャーデバイス番号の最大数
 #define ROOTDEV       1  // ファイルシステムのルートディスクのデバイス番号
 #define MAXARG       32  // execの最大引数数
-#define MAXOPBLOCKS  10  // 任意のFS操作が書き込む最大ブロック数
-#define LOGSIZE      (MAXOPBLOCKS*3)  // オンディスクログ内の最大データブロック数
-#define NBUF         (MAXOPBLOCKS*3)  // ディスクブロックキャッシュのサイズ
+#define MAXSEG        8  // execでデマンドページングするプログラムセグメントの最大数
+#define NVMA         16  // プロセスあたりのmmap()のマッピングの最大数
+#define MAXOPBLOCKS  10  // FS操作が既定で予約するブロック数（mkfsの既定値で、スーパーブロックに記録される）
+#define LOGSIZE      64  // 1つのトランザクションの最大ブロック数の上限（カーネルの配列の大きさ）
+#define LOGBLOCKS    (LOGSIZE*3+1)  // オンディスクログのブロック数の上限（ヘッダーを含み、循環バッファとして使う。mkfsの既定値）
+#define NBUFMIN      (LOGBLOCKS+LOGSIZE*2)  // ディスクブロックキャッシュの最小サイズ（チェックポイント前のログにあるブロック、開いているトランザクションが固定したブロック、ログブロックを同時に保持できる）
+#define NBUF         1024  // ディスクブロックキャッシュの最大サイズ（必要に応じてkallocのページから増やす）
+#define RAMIN        4     // 順次読み出しを検出したときの最初の先読みブロック数
+#define RAMAX        16    // 先読みブロック数の上限
+#define DISKPOLL     0     // 同期ディスクI/Oで完了をポーリングする時間（タイマーのサイクル数、0なら割り込みを待つ）
 #define FSSIZE       2000  // ファイルシステムのサイズ（ブロック数）
 #define MAXPATH      128   // ファイルパス名の最大長
+#define MAXORDER     10    // kalloc_order()で割り当て可能な最大オーダー（2^MAXORDERページ）
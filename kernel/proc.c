@@ -166,6 +166,9 @@ freeproc(struct proc *p)
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
+  p->exe = 0;
+  p->nseg = 0;
+  memset(p->vma, 0, sizeof(p->vma));
   p->state = UNUSED;
 }
 
@@ -248,6 +251,8 @@ userinit(void)
 }
 
 // ユーザーメモリをnバイトだけ増減させる。
+// 増やす場合はp->szを動かすだけで、物理ページは最初のアクセス時に
+// uvmfault()が割り当てる。
 // 成功時は0を返し、失敗時は-1を返す。
 int
 growproc(int n)
@@ -257,11 +262,12 @@ growproc(int n)
 
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
+    if(sz + n > mmapbase(p))
       return -1;
-    }
+    sz += n;
   } else if(n < 0){
     sz = uvmdealloc(p->pagetable, sz, sz + n);
+    segshrink(p, sz);
   }
   p->sz = sz;
   return 0;
@@ -276,6 +282,11 @@ fork(void)
   struct proc *np;
   struct proc *p = myproc();
 
+  // 共有マッピングのページを用意する。ファイルを読むために眠ることがあるので、
+  // 子プロセスのロックを取る前に行う。
+  if(mmapprefork(p) < 0)
+    return -1;
+
   // プロセスを割り当てる。
   if((np = allocproc()) == 0){
     return -1;
@@ -289,6 +300,22 @@ fork(void)
   }
   np->sz = p->sz;
 
+  // mmap()によるマッピングを引き継ぐ。
+  if(mmapfork(p, np) < 0){
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+
+  // まだ読み込まれていないページのために、プログラムセグメントを引き継ぐ。
+  // 親がすでに書き込みを拒否させているので、idenywrite()は失敗しない。
+  if(p->exe){
+    np->exe = idup(p->exe);
+    idenywrite(np->exe);
+  }
+  np->nseg = p->nseg;
+  memmove(np->seg, p->seg, sizeof(p->seg));
+
   // 保存されたユーザーレジスタをコピーする。
   *(np->trapframe) = *(p->trapframe);
 
@@ -343,6 +370,9 @@ exit(int status)
   if(p == initproc)
     panic("init exiting");
 
+  // 共有マッピングの変更をファイルに書き戻してから解除する。
+  munmapall(p);
+
   // オープンしているすべてのファイルを閉じる。
   for(int fd = 0; fd < NOFILE; fd++){
     if(p->ofile[fd]){
@@ -354,8 +384,13 @@ exit(int status)
 
   begin_op();
   iput(p->cwd);
+  if(p->exe){
+    iallowwrite(p->exe);
+    iput(p->exe);
+  }
   end_op();
   p->cwd = 0;
+  p->exe = 0;
 
   acquire(&wait_lock);
 
@@ -76,6 +76,28 @@ struct trapframe {
   /* 280 */ uint64 t6;
 };
 
+// execで読み込んだプログラムセグメント。
+// ページは最初にアクセスされたときにp->exeから読み込まれる。
+struct segment {
+  uint64 va;     // セグメントの先頭の仮想アドレス（ページ境界に揃っている）
+  uint64 memsz;  // メモリ上のサイズ
+  uint off;      // ファイル内のオフセット
+  uint filesz;   // ファイルから読み込むバイト数（残りはゼロ）
+  int perm;      // PTE_R|PTE_U以外に付けるPTEの権限
+};
+
+// mmap()で作成したマッピング。
+// ページは最初にアクセスされたときにファイルから読み込むか、ゼロで埋めて用意する。
+struct vma {
+  int used;        // 使用中なら1
+  uint64 addr;     // マッピングの先頭の仮想アドレス（ページ境界に揃っている）
+  uint64 len;      // マッピングのサイズ（ページサイズの倍数）
+  int prot;        // PROT_READ、PROT_WRITE、PROT_EXEC
+  int flags;       // MAP_SHAREDまたはMAP_PRIVATE、およびMAP_ANONYMOUS
+  uint off;        // addrに対応するファイル内のオフセット
+  struct file *f;  // マッピングしたファイル（匿名マッピングなら0）
+};
+
 // プロセスの状態を表す列挙型
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
@@ -101,5 +123,10 @@ struct proc {
   struct context context;      // プロセスを実行するためのswtch()用のコンテキスト
   struct file *ofile[NOFILE];  // オープンファイル
   struct inode *cwd;           // カレントディレクトリ
+  struct inode *exe;           // 実行中のプログラムのinode（デマンドページング用）
+  int logres;                  // 実行中のFS操作がbegin_op()で予約したログのブロック数
+  int nseg;                    // seg[]の有効な要素数
+  struct segment seg[MAXSEG];  // まだ読み込まれていないページを含むプログラムセグメント
+  struct vma vma[NVMA];        // mmap()によるマッピング
   char name[16];               // プロセス名（デバッグ用）
 };
@@ -469,6 +469,8 @@ typedef uint64 *pagetable_t; // 512 PTEs
 #define PTE_W (1L << 2) // 書き込み可能ビット
 #define PTE_X (1L << 3) // 実行可能ビット
 #define PTE_U (1L << 4) // ユーザーアクセスビット
+#define PTE_D (1L << 7) // ダーティビット（書き込まれたページでハードウェアが立てる）
+#define PTE_COW (1L << 8) // コピーオンライトページ（ソフトウェア用のRSWビット）
 
 // 物理アドレスをPTEにシフト
 #define PA2PTE(pa) ((((uint64)pa) >> 12) << 10)
@@ -10,3 +10,38 @@ struct stat {
   short nlink; // ファイルへのリンク数である
   uint64 size; // ファイルのサイズ（バイト単位）である
 };
+
+// バッファキャッシュの統計情報を表す構造体である
+struct bcachestat {
+  uint64 hits;      // キャッシュにヒットした回数である
+  uint64 misses;    // キャッシュになかったためバッファを割り当てた回数である
+  uint64 evictions; // 他のブロックのために有効なバッファを再利用した回数である
+  int nbuf;         // 現在のバッファ数である
+  int maxbuf;       // バッファ数の上限である
+};
+
+#define NDISKLAT 24 // ディスクの遅延のヒストグラムの要素数である
+
+// virtioディスクの統計情報を表す構造体である
+struct diskstat {
+  uint64 requests;    // デバイスに発行した要求の数である
+  uint64 blocks;      // 要求で転送したブロックの数である
+  uint64 notifies;    // QUEUE_NOTIFYに書き込んだ回数である
+  uint64 notifysaved; // EVENT_IDXによって省いた通知の回数である
+  uint64 intrs;       // ディスクの割り込みの回数である
+  uint64 completions; // 完了した要求の数である
+  uint64 polled;      // ポーリングで完了を見つけた同期I/Oの数である
+  uint64 pollmiss;    // ポーリングの時間内に完了せず、割り込みを待った同期I/Oの数である
+  uint64 poll;        // 完了をポーリングする時間（タイマーのサイクル数）である
+  int indirect;       // 間接ディスクリプタを使っているかどうかである
+  int eventidx;       // EVENT_IDXを使っているかどうかである
+  int nqueue;         // 使っているvirtqueueの数である
+  // 同期I/Oの発行から完了までの時間のヒストグラムである。
+  // i番目の要素は[2^i, 2^(i+1))サイクルかかった要求の数で、最後の要素はそれ以上をすべて数える。
+  uint64 intrhist[NDISKLAT]; // 割り込みで完了を待ったときのヒストグラムである
+  uint64 pollhist[NDISKLAT]; // ポーリングで完了を待ったときのヒストグラムである
+};
+
+// diskctl()のコマンドである
+#define DISK_POLL 1 // 完了をポーリングする時間を設定する
+#define DISK_DROP 2 // バッファキャッシュから使われていないブロックを捨てる
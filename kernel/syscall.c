@@ -102,6 +102,12 @@ extern uint64 sys_unlink(void);
 extern uint64 sys_link(void);
 extern uint64 sys_mkdir(void);
 extern uint64 sys_close(void);
+extern uint64 sys_mmap(void);
+extern uint64 sys_munmap(void);
+extern uint64 sys_bcachestat(void);
+extern uint64 sys_diskstat(void);
+extern uint64 sys_diskctl(void);
+extern uint64 sys_fsync(void);
 
 // syscall.hからのシステムコール番号を
 // システムコールを処理する関数にマッピングする配列である。
@@ -127,6 +133,12 @@ static uint64 (*syscalls[])(void) = {
 [SYS_link]    sys_link,
 [SYS_mkdir]   sys_mkdir,
 [SYS_close]   sys_close,
+[SYS_mmap]    sys_mmap,
+[SYS_munmap]  sys_munmap,
+[SYS_bcachestat] sys_bcachestat,
+[SYS_diskstat] sys_diskstat,
+[SYS_diskctl] sys_diskctl,
+[SYS_fsync]   sys_fsync,
 };
 
 // システムコールを処理する関数である。
@@ -20,3 +20,9 @@
 #define SYS_link   19   // ファイルのリンク作成
 #define SYS_mkdir  20   // ディレクトリの作成
 #define SYS_close  21   // ファイルのクローズ
+#define SYS_mmap   22   // ファイルや匿名メモリのマッピング
+#define SYS_munmap 23   // マッピングの解除
+#define SYS_bcachestat 24 // バッファキャッシュの統計情報の取得
+#define SYS_diskstat 25 // ディスクの統計情報の取得
+#define SYS_diskctl 26 // ディスクの動作の設定
+#define SYS_fsync 27 // ファイルの更新の永続化を待つ
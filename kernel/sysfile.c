@@ -113,6 +113,19 @@ sys_close(void)
   return 0;
 }
 
+// システムコールfsyncの実装。
+// ファイルへの更新を含め、これまでに終わったFSシステムコールの更新がディスクにコミットされるまで待つ。
+uint64
+sys_fsync(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  log_sync();
+  return 0;
+}
+
 // システムコールfstatの実装。
 // ファイルのステータスを取得する。
 uint64
@@ -229,6 +242,7 @@ sys_unlink(void)
     goto bad;
   }
 
+  dcacheforget(dp, name);
   memset(&de, 0, sizeof(de));
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("unlink: writei");
@@ -274,7 +288,7 @@ create(char *path, short type, short major, short minor)
     return 0;
   }
 
-  if((ip = ialloc(dp->dev, type)) == 0){
+  if((ip = ialloc(dp->dev, type, dp->inum)) == 0){
     iunlockput(dp);
     return 0;
   }
@@ -319,7 +333,7 @@ uint64
 sys_open(void)
 {
   char path[MAXPATH];
-  int fd, omode;
+  int fd, omode, writable;
   struct file *f;
   struct inode *ip;
   int n;
@@ -355,9 +369,19 @@ sys_open(void)
     return -1;
   }
 
+  // 実行中のプログラムは書き込み用に開くことも、切り詰めることもできない。
+  writable = (omode & O_WRONLY) || (omode & O_RDWR);
+  if(ip->type == T_FILE && (writable || (omode & O_TRUNC)) && igetwrite(ip) < 0){
+    iunlockput(ip);
+    end_op();
+    return -1;
+  }
+
   if((f = filealloc()) == 0 || (fd = fdalloc(f)) < 0){
     if(f)
       fileclose(f);
+    if(ip->type == T_FILE && (writable || (omode & O_TRUNC)))
+      iputwrite(ip);
     iunlockput(ip);
     end_op();
     return -1;
@@ -372,10 +396,12 @@ sys_open(void)
   }
   f->ip = ip;
   f->readable = !(omode & O_WRONLY);
-  f->writable = (omode & O_WRONLY) || (omode & O_RDWR);
+  f->writable = writable;
 
   if((omode & O_TRUNC) && ip->type == T_FILE){
     itrunc(ip);
+    if(!writable)
+      iputwrite(ip);
   }
 
   iunlock(ip);
@@ -476,7 +502,7 @@ sys_exec(void)
       argv[i] = 0;
       break;
     }
-    argv[i] = kalloc();
+    argv[i] = kalloc_reclaim();
     if(argv[i] == 0)
       goto bad;
     if(fetchstr(uarg, argv[i], PGSIZE) < 0)
@@ -527,3 +553,91 @@ sys_pipe(void)
   }
   return 0;
 }
+
+// システムコールmmapの実装。
+// ファイルまたは無名のメモリをマップする。
+// addrの指定には対応せず、配置するアドレスはカーネルが選ぶ。
+uint64
+sys_mmap(void)
+{
+  uint64 len;
+  int prot, flags, off;
+  struct file *f = 0;
+
+  argaddr(1, &len);
+  argint(2, &prot);
+  argint(3, &flags);
+  argint(5, &off);
+  if((flags & MAP_ANONYMOUS) == 0 && argfd(4, 0, &f) < 0)
+    return -1;
+  if(off < 0)
+    return -1;
+  return mmap(f, len, prot, flags, off);
+}
+
+// システムコールmunmapの実装。
+// [addr, addr+len)のマッピングを解除する。
+uint64
+sys_munmap(void)
+{
+  uint64 addr, len;
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  return munmap(myproc(), addr, len);
+}
+
+// システムコールbcachestatの実装。
+// バッファキャッシュの統計情報をstにコピーする。
+uint64
+sys_bcachestat(void)
+{
+  uint64 addr;
+  struct bcachestat st;
+
+  argaddr(0, &addr);
+  bstat(&st);
+  if(copyout(myproc()->pagetable, addr, (char*)&st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
+
+// システムコールdiskstatの実装。
+// virtioディスクの統計情報をstにコピーする。
+uint64
+sys_diskstat(void)
+{
+  uint64 addr;
+  struct diskstat st;
+
+  argaddr(0, &addr);
+  virtio_disk_stat(&st);
+  if(copyout(myproc()->pagetable, addr, (char*)&st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
+
+// システムコールdiskctlの実装。
+// cmdに応じてディスクとバッファキャッシュを操作する。
+// DISK_POLLはポーリングする時間をargに設定して以前の値を返し、
+// DISK_DROPはバッファキャッシュを縮めて返したページ数を返す。
+uint64
+sys_diskctl(void)
+{
+  int cmd, arg, n, r;
+
+  argint(0, &cmd);
+  argint(1, &arg);
+  switch(cmd){
+  case DISK_POLL:
+    if(arg < 0)
+      return -1;
+    return virtio_disk_poll(arg);
+  case DISK_DROP:
+    n = 0;
+    while((r = bshrink()) > 0)
+      n += r;
+    return n;
+  }
+  return -1;
+}
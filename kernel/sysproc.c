@@ -40,6 +40,9 @@ sys_wait(void)
 {
   uint64 p;
   argaddr(0, &p);
+  // wait()はスピンロックを保持したままcopyout()するので、先にページを用意しておく。
+  if(p != 0 && uvmprefault(p, sizeof(int), 1) != sizeof(int))
+    return -1;
   return wait(p);
 }
 
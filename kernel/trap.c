@@ -60,6 +60,18 @@ usertrap(void)
     intr_on();
 
     syscall();
+  } else if(r_scause() == 12 || r_scause() == 13 || r_scause() == 15){
+    // 命令、ロード、ストアのページフォルト。
+    // プログラムセグメントの読み込みで眠る可能性があるので、
+    // scauseとstvalを読み終えてから割り込みを有効にする。
+    uint64 scause = r_scause();
+    uint64 stval = r_stval();
+    intr_on();
+    if(uvmfault(p, stval, scause == 15) != 0){
+      printf("usertrap(): page fault scause 0x%lx pid=%d\n", scause, p->pid);
+      printf("            sepc=0x%lx stval=0x%lx\n", p->trapframe->epc, stval);
+      setkilled(p);
+    }
   } else if((which_dev = devintr()) != 0){
     // 正常処理
   } else {
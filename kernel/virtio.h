@@ -29,6 +29,7 @@
 #define VIRTIO_MMIO_DRIVER_DESC_HIGH   0x094 // 上位アドレス
 #define VIRTIO_MMIO_DEVICE_DESC_LOW    0x0a0 // ユーズドリングの物理アドレス, 書き込み専用
 #define VIRTIO_MMIO_DEVICE_DESC_HIGH   0x0a4 // 上位アドレス
+#define VIRTIO_MMIO_CONFIG             0x100 // デバイス固有のコンフィグ領域
 
 // ステータスレジスタビット, qemu virtio_config.h より
 #define VIRTIO_CONFIG_S_ACKNOWLEDGE    1 // ACKビット
@@ -47,7 +48,14 @@
 
 // この数の virtio ディスクリプタが必要。
 // 2 の累乗でなければならない。
-#define NUM 8
+// 先読みで複数の要求を同時に発行するため、三つ組で20要求ほど入る大きさにしている。
+#define NUM 64
+
+// 1つの要求にまとめる連続ブロックの最大数。
+// 間接ディスクリプタが使えない場合、要求はヘッダとステータスを含めて
+// VIRTIO_MAXSEG+2個のディスクリプタを使うので、NUM-2以下でなければならない。
+// qemuのvirtio-blkのseg_max（キューサイズ-2）も下回るようにしている。
+#define VIRTIO_MAXSEG 32
 
 // 仕様書に基づく単一のディスクリプタ。
 struct virtq_desc {
@@ -58,13 +66,14 @@ struct virtq_desc {
 };
 #define VRING_DESC_F_NEXT  1 // 他のディスクリプタとチェーン
 #define VRING_DESC_F_WRITE 2 // デバイスが書き込み（vs 読み取り）
+#define VRING_DESC_F_INDIRECT 4 // addrはディスクリプタの間接テーブルを指す
 
 // 仕様書に基づくアベイラブルリング全体。
 struct virtq_avail {
   uint16 flags; // 常にゼロ
   uint16 idx;   // ドライバが次に書き込む ring[idx]
   uint16 ring[NUM]; // チェーンヘッドのディスクリプタ番号
-  uint16 unused;
+  uint16 used_event; // EVENT_IDX: usedリングのidxがこの値を越えたときだけ割り込みを要求する
 };
 
 // "ユーズド" リングの1エントリで、デバイスが完了したリクエストをドライバに通知する。
@@ -77,13 +86,23 @@ struct virtq_used {
   uint16 flags; // 常にゼロ
   uint16 idx;   // デバイスが ring[] エントリを追加するときにインクリメント
   struct virtq_used_elem ring[NUM];
+  uint16 avail_event; // EVENT_IDX: availリングのidxがこの値を越えたときだけ通知を要求する
 };
 
+// EVENT_IDXで、idxをoldからnew_idxに進めたときにevent_idxを越えたかどうか。
+// 越えていれば相手に通知する必要がある。
+#define VRING_NEED_EVENT(event_idx, new_idx, old) \
+  ((uint16)((new_idx) - (event_idx) - 1) < (uint16)((new_idx) - (old)))
+
 // これらは特定の virtio ブロックデバイス（例: ディスク）に関連するもので、
 // 仕様書のセクション5.2に記載されている。
 
+// struct virtio_blk_configでのnum_queues（uint16）のオフセット
+#define VIRTIO_BLK_CONFIG_NUM_QUEUES 34
+
 #define VIRTIO_BLK_T_IN  0 // ディスクの読み取り
 #define VIRTIO_BLK_T_OUT 1 // ディスクの書き込み
+#define VIRTIO_BLK_SECTSIZE 512 // 要求のsectorの単位（バイト）
 
 // ディスクリクエスト内の最初のディスクリプタの形式。
 // これに続いてブロックを含む2つのディスクリプタと1バイトのステータスが続く。
@@ -2,7 +2,11 @@
 // qemuのvirtioディスクデバイス用ドライバ。
 // qemuのmmioインターフェイスを使用。
 //
-// qemu ... -drive file=fs.img,if=none,format=raw,id=x0 -device virtio-blk-device,drive=x0,bus=virtio-mmio-bus.0
+// qemu ... -drive file=fs.img,if=none,format=raw,id=x0 -device virtio-blk-device,drive=x0,bus=virtio-mmio-bus.0,num-queues=3
+//
+// デバイスがVIRTIO_BLK_F_MQを提供していれば、CPUごとに別のvirtqueueを使い、
+// 各キューは自分のロックで守る。要求は発行したCPUのキューに入れるので、
+// 複数のCPUからの読み書きが1つのロックで直列化されない。
 //
 
 #include "types.h"
@@ -14,12 +18,20 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "stat.h"
 #include "virtio.h"
 
 // virtio mmioレジスタのアドレス。
 #define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
 
-static struct disk {
+#if BSIZE % VIRTIO_BLK_SECTSIZE != 0
+#error "BSIZE must be a multiple of the virtio sector size"
+#endif
+
+// 1つのvirtqueueとその管理情報。
+struct vqueue {
+  int id; // キュー番号
+
   // DMAディスクリプタのセット。各ディスクリプタは個別のディスク操作の読み書き先をデバイスに指示。
   struct virtq_desc *desc;
 
@@ -32,27 +44,94 @@ static struct disk {
   // 内部管理用。
   char free[NUM];  // ディスクリプタの空き状況
   uint16 used_idx; // usedリングの処理済み位置
+  uint16 kicked_idx;  // 最後に通知を判断したときのavail->idx
 
   // 処理中の操作に関する情報を保持。
   struct {
-    struct buf *b;
+    struct buf *b[VIRTIO_MAXSEG]; // 要求に含まれる連続ブロックのバッファ
+    int n;                        // b[]の有効な要素数
     char status;
+    char async;  // 完了を待つプロセスがなく、割り込みでbiodone()を呼ぶ要求
   } info[NUM];
 
   // ディスクコマンドヘッダ。
   struct virtio_blk_req ops[NUM];
 
-  struct spinlock vdisk_lock;
+  // 間接ディスクリプタのテーブル。先頭ディスクリプタの番号ごとに1つずつ持つ。
+  // INDIRECT_DESCを使う場合、要求はリングのディスクリプタを1つしか使わない。
+  struct virtq_desc indirect[NUM][VIRTIO_MAXSEG+2];
+
+  // 統計情報。
+  struct diskstat stat;
+
+  struct spinlock lock;
+};
+
+static struct disk {
+  struct vqueue q[NCPU];
+  int nq;             // 使っているキューの数
+
+  int use_indirect;   // VIRTIO_RING_F_INDIRECT_DESCをネゴシエートした
+  int use_event_idx;  // VIRTIO_RING_F_EVENT_IDXをネゴシエートした
 
+  // 同期I/Oで完了をポーリングする時間（タイマーのサイクル数）。0なら割り込みを待つ。
+  uint64 poll;
 } disk;
 
+// キューqを初期化してデバイスに登録する。
+static void
+queue_init(struct vqueue *q, int id)
+{
+  q->id = id;
+  initlock(&q->lock, "virtio_disk");
+
+  *R(VIRTIO_MMIO_QUEUE_SEL) = id;
+
+  // キューが使用中でないことを確認
+  if(*R(VIRTIO_MMIO_QUEUE_READY))
+    panic("virtio disk should not be ready");
+
+  // 最大キューサイズを確認
+  uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
+  if(max == 0)
+    panic("virtio disk has no queue");
+  if(max < NUM)
+    panic("virtio disk max queue too short");
+
+  // キューメモリの割り当てと初期化
+  q->desc = kalloc();
+  q->avail = kalloc();
+  q->used = kalloc();
+  if(!q->desc || !q->avail || !q->used)
+    panic("virtio disk kalloc");
+  memset(q->desc, 0, PGSIZE);
+  memset(q->avail, 0, PGSIZE);
+  memset(q->used, 0, PGSIZE);
+
+  // キューサイズの設定
+  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
+
+  // 物理アドレスの設定
+  *R(VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64)q->desc;
+  *R(VIRTIO_MMIO_QUEUE_DESC_HIGH) = (uint64)q->desc >> 32;
+  *R(VIRTIO_MMIO_DRIVER_DESC_LOW) = (uint64)q->avail;
+  *R(VIRTIO_MMIO_DRIVER_DESC_HIGH) = (uint64)q->avail >> 32;
+  *R(VIRTIO_MMIO_DEVICE_DESC_LOW) = (uint64)q->used;
+  *R(VIRTIO_MMIO_DEVICE_DESC_HIGH) = (uint64)q->used >> 32;
+
+  // キューが準備完了
+  *R(VIRTIO_MMIO_QUEUE_READY) = 0x1;
+
+  // 全てのディスクリプタを未使用に設定
+  for(int i = 0; i < NUM; i++)
+    q->free[i] = 1;
+}
+
 void
 virtio_disk_init(void)
 {
   uint32 status = 0;
 
-  initlock(&disk.vdisk_lock, "virtio_disk");
-
   if(*R(VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
      *R(VIRTIO_MMIO_VERSION) != 2 ||
      *R(VIRTIO_MMIO_DEVICE_ID) != 2 ||
@@ -76,10 +155,11 @@ virtio_disk_init(void)
   features &= ~(1 << VIRTIO_BLK_F_RO);
   features &= ~(1 << VIRTIO_BLK_F_SCSI);
   features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
-  features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
-  features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
-  features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
+  // EVENT_IDX、INDIRECT_DESC、MQはデバイスが提供していれば使う。
+  disk.use_event_idx = (features >> VIRTIO_RING_F_EVENT_IDX) & 1;
+  disk.use_indirect = (features >> VIRTIO_RING_F_INDIRECT_DESC) & 1;
+  disk.poll = DISKPOLL;
   *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
 
   // 機能ネゴシエーションが完了したことをデバイスに通知
@@ -91,47 +171,18 @@ virtio_disk_init(void)
   if(!(status & VIRTIO_CONFIG_S_FEATURES_OK))
     panic("virtio disk FEATURES_OK unset");
 
-  // キュー0の初期化
-  *R(VIRTIO_MMIO_QUEUE_SEL) = 0;
-
-  // キュー0が使用中でないことを確認
-  if(*R(VIRTIO_MMIO_QUEUE_READY))
-    panic("virtio disk should not be ready");
-
-  // 最大キューサイズを確認
-  uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
-  if(max == 0)
-    panic("virtio disk has no queue 0");
-  if(max < NUM)
-    panic("virtio disk max queue too short");
-
-  // キューメモリの割り当てと初期化
-  disk.desc = kalloc();
-  disk.avail = kalloc();
-  disk.used = kalloc();
-  if(!disk.desc || !disk.avail || !disk.used)
-    panic("virtio disk kalloc");
-  memset(disk.desc, 0, PGSIZE);
-  memset(disk.avail, 0, PGSIZE);
-  memset(disk.used, 0, PGSIZE);
-
-  // キューサイズの設定
-  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
-
-  // 物理アドレスの設定
-  *R(VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64)disk.desc;
-  *R(VIRTIO_MMIO_QUEUE_DESC_HIGH) = (uint64)disk.desc >> 32;
-  *R(VIRTIO_MMIO_DRIVER_DESC_LOW) = (uint64)disk.avail;
-  *R(VIRTIO_MMIO_DRIVER_DESC_HIGH) = (uint64)disk.avail >> 32;
-  *R(VIRTIO_MMIO_DEVICE_DESC_LOW) = (uint64)disk.used;
-  *R(VIRTIO_MMIO_DEVICE_DESC_HIGH) = (uint64)disk.used >> 32;
-
-  // キューが準備完了
-  *R(VIRTIO_MMIO_QUEUE_READY) = 0x1;
+  // キューの数はデバイスのコンフィグ領域にある。CPUの数より多くは使わない。
+  disk.nq = 1;
+  if(features & (1 << VIRTIO_BLK_F_MQ))
+    disk.nq = *(volatile uint16 *)(VIRTIO0 + VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CONFIG_NUM_QUEUES);
+  if(disk.nq < 1)
+    disk.nq = 1;
+  if(disk.nq > NCPU)
+    disk.nq = NCPU;
 
-  // 全てのディスクリプタを未使用に設定
-  for(int i = 0; i < NUM; i++)
-    disk.free[i] = 1;
+  // キューの初期化
+  for(int i = 0; i < disk.nq; i++)
+    queue_init(&disk.q[i], i);
 
   // デバイスが完全に準備完了したことを通知
   status |= VIRTIO_CONFIG_S_DRIVER_OK;
@@ -142,11 +193,11 @@ virtio_disk_init(void)
 
 // 空きディスクリプタを見つけ、使用中にマークし、そのインデックスを返す
 static int
-alloc_desc()
+alloc_desc(struct vqueue *q)
 {
   for(int i = 0; i < NUM; i++){
-    if(disk.free[i]){
-      disk.free[i] = 0;
+    if(q->free[i]){
+      q->free[i] = 0;
       return i;
     }
   }
@@ -155,28 +206,28 @@ alloc_desc()
 
 // ディスクリプタを未使用にマーク
 static void
-free_desc(int i)
+free_desc(struct vqueue *q, int i)
 {
   if(i >= NUM)
     panic("free_desc 1");
-  if(disk.free[i])
+  if(q->free[i])
     panic("free_desc 2");
-  disk.desc[i].addr = 0;
-  disk.desc[i].len = 0;
-  disk.desc[i].flags = 0;
-  disk.desc[i].next = 0;
-  disk.free[i] = 1;
-  wakeup(&disk.free[0]);
+  q->desc[i].addr = 0;
+  q->desc[i].len = 0;
+  q->desc[i].flags = 0;
+  q->desc[i].next = 0;
+  q->free[i] = 1;
+  wakeup(&q->free[0]);
 }
 
 // ディスクリプタのチェーンを解放
 static void
-free_chain(int i)
+free_chain(struct vqueue *q, int i)
 {
   while(1){
-    int flag = disk.desc[i].flags;
-    int nxt = disk.desc[i].next;
-    free_desc(i);
+    int flag = q->desc[i].flags;
+    int nxt = q->desc[i].next;
+    free_desc(q, i);
     if(flag & VRING_DESC_F_NEXT)
       i = nxt;
     else
@@ -184,46 +235,56 @@ free_chain(int i)
   }
 }
 
-// 三つのディスクリプタを割り当てる（連続でなくてもよい）
-// ディスク転送は常に三つのディスクリプタを使用
+// n個のディスクリプタを割り当てる（連続でなくてもよい）
+// ディスク転送はヘッダ、データ、ステータスで、データのブロック数+2個のディスクリプタを使用
 static int
-alloc3_desc(int *idx)
+alloc_descs(struct vqueue *q, int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
-    idx[i] = alloc_desc();
+  for(int i = 0; i < n; i++){
+    idx[i] = alloc_desc(q);
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
-        free_desc(idx[j]);
+        free_desc(q, idx[j]);
       return -1;
     }
   }
   return 0;
 }
 
-// ディスクの読み書きを行う
-void
-virtio_disk_rw(struct buf *b, int write)
+// ディスク上で連続するn個のブロックのバッファbs[]について、1つの読み書き要求を組み立て、
+// キューqのavailリングに入れる。idxは割り当て済みのディスクリプタで、
+// 間接ディスクリプタを使う場合は1個、使わない場合はn+2個である。
+// デバイスへの通知はnotify()でまとめて行う。q->lockを保持している必要がある。
+static void
+queue(struct vqueue *q, struct buf **bs, int n, int write, int *idx, int async)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
-
-  acquire(&disk.vdisk_lock);
-
-  // 標準のSection 5.2によると、レガシーブロック操作は三つのディスクリプタを使用：
-  // 一つはtype/reserved/sector用、一つはデータ用、一つは1バイトのステータス結果用
-
-  // 三つのディスクリプタを割り当て
-  int idx[3];
-  while(1){
-    if(alloc3_desc(idx) == 0) {
-      break;
-    }
-    sleep(&disk.free[0], &disk.vdisk_lock);
+  uint64 sector = bs[0]->blockno * (BSIZE / VIRTIO_BLK_SECTSIZE);
+  struct virtq_desc *d;
+  int pos[VIRTIO_MAXSEG+2];
+  int i, head = idx[0];
+
+  // 標準のSection 5.2によると、レガシーブロック操作は
+  // type/reserved/sector用、データ用、1バイトのステータス結果用のディスクリプタを使用する。
+  // データのディスクリプタを複数つなげると、連続したセクタを一度に転送できる。
+  // 間接ディスクリプタを使う場合は、これらを先頭ディスクリプタ専用のテーブルに並べ、
+  // リングのディスクリプタはそのテーブルを指すだけにする。
+  if(disk.use_indirect){
+    d = q->indirect[head];
+    for(i = 0; i < n+2; i++)
+      pos[i] = i;
+    q->desc[head].addr = (uint64) d;
+    q->desc[head].len = (n+2) * sizeof(struct virtq_desc);
+    q->desc[head].flags = VRING_DESC_F_INDIRECT;
+    q->desc[head].next = 0;
+  } else {
+    d = q->desc;
+    for(i = 0; i < n+2; i++)
+      pos[i] = idx[i];
   }
 
-  // 三つのディスクリプタをフォーマット
   // qemuのvirtio-blk.cはこれらを読み込む
 
-  struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
+  struct virtio_blk_req *buf0 = &q->ops[head];
 
   if(write)
     buf0->type = VIRTIO_BLK_T_OUT; // ディスクへの書き込み
@@ -232,58 +293,235 @@ virtio_disk_rw(struct buf *b, int write)
   buf0->reserved = 0;
   buf0->sector = sector;
 
-  disk.desc[idx[0]].addr = (uint64) buf0;
-  disk.desc[idx[0]].len = sizeof(struct virtio_blk_req);
-  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk.desc[idx[0]].next = idx[1];
-
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // デバイスがb->dataを読み取る
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // デバイスがb->dataに書き込む
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
-
-  disk.info[idx[0]].status = 0xff; // デバイスは成功時に0を書き込む
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // デバイスがステータスを書き込む
-  disk.desc[idx[2]].next = 0;
+  d[pos[0]].addr = (uint64) buf0;
+  d[pos[0]].len = sizeof(struct virtio_blk_req);
+  d[pos[0]].flags = VRING_DESC_F_NEXT;
+  d[pos[0]].next = pos[1];
+
+  for(i = 1; i <= n; i++){
+    struct buf *b = bs[i-1];
+    d[pos[i]].addr = (uint64) b->data;
+    d[pos[i]].len = BSIZE;
+    if(write)
+      d[pos[i]].flags = 0; // デバイスがb->dataを読み取る
+    else
+      d[pos[i]].flags = VRING_DESC_F_WRITE; // デバイスがb->dataに書き込む
+    d[pos[i]].flags |= VRING_DESC_F_NEXT;
+    d[pos[i]].next = pos[i+1];
+
+    // virtio_disk_intr()のためのstruct bufを記録
+    b->disk = 1;
+    b->qid = q->id;
+    q->info[head].b[i-1] = b;
+  }
+  q->info[head].n = n;
+  q->info[head].async = async;
 
-  // virtio_disk_intr()のためのstruct bufを記録
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  q->info[head].status = 0xff; // デバイスは成功時に0を書き込む
+  d[pos[n+1]].addr = (uint64) &q->info[head].status;
+  d[pos[n+1]].len = 1;
+  d[pos[n+1]].flags = VRING_DESC_F_WRITE; // デバイスがステータスを書き込む
+  d[pos[n+1]].next = 0;
 
   // ディスクリプタのチェーンの最初のインデックスをデバイスに通知
-  disk.avail->ring[disk.avail->idx % NUM] = idx[0];
+  q->avail->ring[q->avail->idx % NUM] = head;
 
   __sync_synchronize();
 
   // デバイスに新しいavailリングエントリがあることを通知
-  disk.avail->idx += 1; // % NUMではない...
+  q->avail->idx += 1; // % NUMではない...
+  q->stat.requests++;
+  q->stat.blocks += n;
+}
+
+// キューqのavailリングに入れた要求をデバイスに知らせる。
+// EVENT_IDXを使う場合、デバイスがまだ前の要求を処理していてavail_eventを越えていなければ、
+// デバイスは通知なしで新しい要求も拾うので、通知を省く。
+static void
+notify(struct vqueue *q)
+{
+  uint16 old = q->kicked_idx, new = q->avail->idx;
 
   __sync_synchronize();
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // 値はキュー番号
+  q->kicked_idx = new;
+  if(disk.use_event_idx && !VRING_NEED_EVENT(q->used->avail_event, new, old)){
+    q->stat.notifysaved++;
+    return;
+  }
+  q->stat.notifies++;
+  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = q->id; // 値はキュー番号
+}
+
+// n個のロックされたバッファbs[]の読み書き要求をまとめてキューに入れ、完了を待たずに戻る。
+// 要求は呼び出したCPUのキューに入れる。
+// bs[]の中で隣り合い、ディスク上でも連続するブロックはVIRTIO_MAXSEG個まで1つの要求にまとめる。
+// デバイスへの通知は最後に一度だけ行う。ディスクリプタが足りなくなったら、
+// それまでの要求を通知してから空くのを待つ。
+// asyncが0なら呼び出し元が各バッファについてvirtio_disk_wait()で完了を待つ。
+// asyncが1なら読み込みのみで、完了時に割り込みハンドラがbiodone()を呼ぶ。
+// 先読みのためにロックしたバッファを抱えたまま眠らないよう、asyncが1のときは
+// ディスクリプタが足りなくなった時点であきらめる。
+// キューに入れたバッファの数を返す。asyncが0なら常にnである。
+int
+virtio_disk_submit(struct buf **bs, int n, int write, int async)
+{
+  int idx[VIRTIO_MAXSEG+2], queued = 0, i, k;
+  struct vqueue *q;
+
+  // 途中で別のCPUに移っても、同じキューを使い続けるだけなので問題ない。
+  push_off();
+  q = &disk.q[cpuid() % disk.nq];
+  pop_off();
+
+  acquire(&q->lock);
+  for(i = 0; i < n; i += k){
+    // 連続するブロックの並びを1つの要求にする。
+    for(k = 1; i + k < n && k < VIRTIO_MAXSEG; k++)
+      if(bs[i+k]->dev != bs[i]->dev || bs[i+k]->blockno != bs[i+k-1]->blockno + 1)
+        break;
+
+    // 間接ディスクリプタを使うなら1個、使わないならヘッダ、k個のデータ、ステータスの分を割り当て
+    while(alloc_descs(q, idx, disk.use_indirect ? 1 : k+2) != 0){
+      if(async)
+        goto out;
+      if(queued){
+        notify(q);
+        queued = 0;
+      }
+      sleep(&q->free[0], &q->lock);
+    }
+    queue(q, &bs[i], k, write, idx, async);
+    queued++;
+  }
+ out:
+  if(queued)
+    notify(q);
+  release(&q->lock);
+  return i;
+}
+
+// キューqのusedリングに入った完了をすべて処理する。q->lockを保持している必要がある。
+// 割り込みハンドラと、ポーリング中のvirtio_disk_wait()から呼ばれる。
+static void
+complete(struct vqueue *q)
+{
+  // デバイスはusedリングにエントリを追加するたびにq->used->idxをインクリメントする
+  // EVENT_IDXを使う場合、used_eventを更新するまでデバイスは割り込みを上げないので、
+  // このループで処理している間に完了した要求は割り込みなしでまとめて拾える。
+
+  while(1){
+    while(q->used_idx != q->used->idx){
+      __sync_synchronize();
+      int id = q->used->ring[q->used_idx % NUM].id;
+
+      if(q->info[id].status != 0)
+        panic("virtio_disk_intr status");
+
+      int async = q->info[id].async;
+      int n = q->info[id].n;
+      struct buf *bs[VIRTIO_MAXSEG];
+      for(int i = 0; i < n; i++){
+        bs[i] = q->info[id].b[i];
+        q->info[id].b[i] = 0;
+      }
+      // 待っているプロセスがいない要求もあるので、ディスクリプタはここで解放する。
+      free_chain(q, id);
+
+      for(int i = 0; i < n; i++){
+        bs[i]->disk = 0;   // ディスクはバッファを使い終わった
+        if(async)
+          biodone(bs[i]);
+        else
+          wakeup(bs[i]);
+      }
+
+      q->used_idx += 1;
+      q->stat.completions++;
+    }
+
+    if(!disk.use_event_idx)
+      break;
+
+    // 次の完了で割り込みを要求してから、その間に完了したものがないか確かめ直す。
+    q->avail->used_event = q->used_idx;
+    __sync_synchronize();
+    if(q->used_idx == q->used->idx)
+      break;
+  }
+}
+
+// bの要求が完了するのを待つ。bの要求を入れたキューqのロックを保持している必要がある。
+// ポーリングモードでは、眠る前に最大disk.pollサイクルの間usedリングを見て自分で完了を処理し、
+// sleep()とwakeup()による受け渡しを省く。時間内に完了しなければ割り込みを待つ。
+static void
+waitbuf(struct vqueue *q, struct buf *b)
+{
+  uint64 start, poll = disk.poll;
+
+  if(poll > 0 && b->disk == 1){
+    start = r_time();
+    while(b->disk == 1 && r_time() - start < poll){
+      if(q->used_idx != q->used->idx){
+        complete(q);
+      } else {
+        // 他のCPUが要求を発行したり割り込みを処理したりできるようにロックを手放す。
+        release(&q->lock);
+        acquire(&q->lock);
+      }
+    }
+    if(b->disk == 0)
+      q->stat.polled++;
+    else
+      q->stat.pollmiss++;
+  }
 
   // virtio_disk_intr()が要求の完了を通知するのを待つ
   while(b->disk == 1) {
-    sleep(b, &disk.vdisk_lock);
+    sleep(b, &q->lock);
   }
+}
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+// virtio_disk_submit()で発行したbの要求が完了するのを待つ。
+void
+virtio_disk_wait(struct buf *b)
+{
+  struct vqueue *q = &disk.q[b->qid];
 
-  release(&disk.vdisk_lock);
+  acquire(&q->lock);
+  waitbuf(q, b);
+  release(&q->lock);
 }
 
+// ディスクの読み書きを行い、完了を待つ
+// 発行から完了を待ち終えるまでの時間を、そのときのモードのヒストグラムに記録する。
 void
-virtio_disk_intr()
+virtio_disk_rw(struct buf *b, int write)
 {
-  acquire(&disk.vdisk_lock);
+  struct vqueue *q;
+  uint64 start, t;
+  int i;
+
+  start = r_time();
+  virtio_disk_submit(&b, 1, write, 0);
+  q = &disk.q[b->qid];
+  acquire(&q->lock);
+  waitbuf(q, b);
+  t = r_time() - start;
+  for(i = 0; i < NDISKLAT-1 && t >= (2UL << i); i++)
+    ;
+  if(disk.poll > 0)
+    q->stat.pollhist[i]++;
+  else
+    q->stat.intrhist[i]++;
+  release(&q->lock);
+}
 
+// virtio-mmioの割り込みはデバイスに1本しかなく、どのキューの完了かはわからないので、
+// すべてのキューを調べる。ポーリングモードでは、要求を発行したCPUが自分で完了を処理する。
+void
+virtio_disk_intr()
+{
   // デバイスはこの行で割り込みをクリアする
   // 新しいエントリがusedリングに書き込まれると、次の割り込みが発生する可能性があるが、
   // それは問題ない。
@@ -291,21 +529,49 @@ virtio_disk_intr()
 
   __sync_synchronize();
 
-  // デバイスはusedリングにエントリを追加するたびにdisk.used->idxをインクリメントする
-
-  while(disk.used_idx != disk.used->idx){
-    __sync_synchronize();
-    int id = disk.used->ring[disk.used_idx % NUM].id;
-
-    if(disk.info[id].status != 0)
-      panic("virtio_disk_intr status");
+  for(int i = 0; i < disk.nq; i++){
+    struct vqueue *q = &disk.q[i];
+    acquire(&q->lock);
+    if(q->used_idx != q->used->idx){
+      q->stat.intrs++;
+      complete(q);
+    }
+    release(&q->lock);
+  }
+}
 
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // ディスクはバッファを使い終わった
-    wakeup(b);
+// 同期I/Oで完了をポーリングする時間をタイマーのサイクル数で設定し、以前の値を返す。
+// 0なら割り込みを待つ。
+uint64
+virtio_disk_poll(uint64 cycles)
+{
+  return __sync_lock_test_and_set(&disk.poll, cycles);
+}
 
-    disk.used_idx += 1;
+// ディスクの統計情報をstに書き込む。すべてのキューの値を合計する。
+void
+virtio_disk_stat(struct diskstat *st)
+{
+  memset(st, 0, sizeof(*st));
+  for(int i = 0; i < disk.nq; i++){
+    struct vqueue *q = &disk.q[i];
+    acquire(&q->lock);
+    st->requests += q->stat.requests;
+    st->blocks += q->stat.blocks;
+    st->notifies += q->stat.notifies;
+    st->notifysaved += q->stat.notifysaved;
+    st->intrs += q->stat.intrs;
+    st->completions += q->stat.completions;
+    st->polled += q->stat.polled;
+    st->pollmiss += q->stat.pollmiss;
+    for(int j = 0; j < NDISKLAT; j++){
+      st->intrhist[j] += q->stat.intrhist[j];
+      st->pollhist[j] += q->stat.pollhist[j];
+    }
+    release(&q->lock);
   }
-
-  release(&disk.vdisk_lock);
+  st->indirect = disk.use_indirect;
+  st->eventidx = disk.use_event_idx;
+  st->poll = disk.poll;
+  st->nqueue = disk.nq;
 }
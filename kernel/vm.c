@@ -3,8 +3,11 @@
 #include "memlayout.h"
 #include "elf.h"
 #include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
 #include "defs.h"
 #include "fs.h"
+#include "fcntl.h"
 
 /*
  * カーネルのページテーブル。
@@ -157,7 +160,7 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 }
 
 // vaから始まるnpagesのマッピングを削除する。vaはページ境界に揃える必要がある。
-// マッピングは存在している必要がある。
+// 遅延割り当てでまだマッピングされていないページは読み飛ばす。
 // オプションで物理メモリを解放する。
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
@@ -170,9 +173,9 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 
   for (a = va; a < va + npages * PGSIZE; a += PGSIZE) {
     if ((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
+      continue;
     if ((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+      continue;
     if (PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
     if (do_free) {
@@ -212,6 +215,7 @@ uvmfirst(pagetable_t pagetable, uchar *src, uint sz)
 }
 
 // プロセスをoldszからnewszに拡張するためにPTEと物理メモリを割り当てる。
+// メモリ不足ならバッファキャッシュを縮小するので、スピンロックを保持したまま呼んではならない。
 // ニューサイズまたはエラー時に0を返す。
 uint64
 uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
@@ -223,7 +227,7 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
     return oldsz;
   oldsz = PGROUNDUP(oldsz);
   for (a = oldsz; a < newsz; a += PGSIZE) {
-    mem = kalloc();
+    mem = kalloc_reclaim();
     if (mem == 0) {
       uvmdealloc(pagetable, a, oldsz);
       return 0;
@@ -286,39 +290,195 @@ uvmfree(pagetable_t pagetable, uint64 sz)
 }
 
 // 親プロセスのページテーブルから子プロセスのページテーブルにメモリをコピーする。
-// ページテーブルと物理メモリの両方をコピーする。
+// 物理メモリはコピーせず、両方のページテーブルから同じページを参照する。
+// 書き込み可能なページは両方で読み取り専用のコピーオンライトページにし、
+// 最初の書き込みでuvmcow()がページを複製する。
 // 成功した場合は0を返し、失敗した場合は-1を返す。
-// 失敗した場合、割り当てられたページをすべて解放する。
+// 失敗した場合、子プロセスに作成したマッピングをすべて解除する。
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+{
+  return uvmcopyrange(old, new, 0, sz, 1);
+}
+
+// uvmcopy()と同じように、ページ境界に揃った[va, va+len)のマッピングを子プロセスにコピーする。
+// cowが0なら書き込み可能なページもそのまま共有し、親子の書き込みが互いに見えるようにする。
+int
+uvmcopyrange(pagetable_t old, pagetable_t new, uint64 va, uint64 len, int cow)
 {
   pte_t *pte;
   uint64 pa, i;
   uint flags;
-  char *mem;
 
-  for (i = 0; i < sz; i += PGSIZE) {
-    if ((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
-    if ((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+  for (i = va; i < va + len; i += PGSIZE) {
+    if ((pte = walk(old, i, 0)) == 0 || (*pte & PTE_V) == 0)
+      continue; // 遅延割り当てでまだ割り当てられていないページ
+    if (cow && (*pte & PTE_W))
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if ((mem = kalloc()) == 0)
-      goto err;
-    memmove(mem, (char *)pa, PGSIZE);
-    if (mappages(new, i, PGSIZE, (uint64)mem, flags) != 0) {
-      kfree(mem);
+    if (mappages(new, i, PGSIZE, pa, flags) != 0)
       goto err;
-    }
+    krefinc((void *)pa);
   }
   return 0;
 
 err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  uvmunmap(new, va, (i - va) / PGSIZE, 1);
   return -1;
 }
 
+// 仮想アドレスvaを含むコピーオンライトページを書き込み可能にする。
+// ページが他のページテーブルと共有されていれば新しいページに複製し、
+// 最後の参照であればそのまま書き込み可能にする。
+// uvmfault()と同じく、スピンロックを保持したまま呼んではならない。
+// 成功した場合は0を返し、vaがコピーオンライトページでない場合やメモリ不足の場合は-1を返す。
+int
+uvmcow(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+
+  if (va >= MAXVA)
+    return -1;
+  pte = walk(pagetable, PGROUNDDOWN(va), 0);
+  if (pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0 ||
+      (*pte & PTE_COW) == 0)
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+
+  if (krefcnt((void *)pa) == 1) {
+    // 他に共有しているページテーブルがないので複製は不要。
+    *pte = PA2PTE(pa) | flags;
+    return 0;
+  }
+
+  if ((mem = kalloc_reclaim()) == 0)
+    return -1;
+  memmove(mem, (char *)pa, PGSIZE);
+  *pte = PA2PTE(mem) | flags;
+  kfree((void *)pa);
+  return 0;
+}
+
+// 仮想アドレスvaを含むexecのプログラムセグメントを返す。なければ0を返す。
+static struct segment *
+findseg(struct proc *p, uint64 va)
+{
+  struct segment *s;
+
+  for (s = p->seg; s < &p->seg[p->nseg]; s++)
+    if (va >= s->va && va < s->va + s->memsz)
+      return s;
+  return 0;
+}
+
+// プロセスpのユーザー仮想アドレスvaで発生したページフォルトを処理する。
+// writeが非0ならストアによるフォルトである。
+// コピーオンライトページへの書き込みであればページを複製し、
+// p->sz未満かmmap()の範囲内でまだ割り当てられていないページであればページを割り当てる。
+// mmap()したファイルやexecのプログラムセグメント内のページはファイルから読み込み、
+// それ以外はゼロで埋める。
+// ファイルを読むために眠ることがあるので、スピンロックを保持したまま呼んではならない。
+// スピンロックを保持したままcopyin()/copyout()する経路は、先にuvmprefault()で
+// ページを用意し、用意できた範囲だけをコピーすること。
+// 処理できた場合は0を返し、不正なアクセスやメモリ不足の場合は-1を返す。
+int
+uvmfault(struct proc *p, uint64 va, int write)
+{
+  pte_t *pte;
+  char *mem;
+  struct segment *s;
+  struct vma *v;
+  int perm;
+
+  if (va >= MAXVA)
+    return -1;
+  va = PGROUNDDOWN(va);
+
+  pte = walk(p->pagetable, va, 0);
+  if (pte && (*pte & PTE_V)) {
+    if (write && (*pte & PTE_COW))
+      return uvmcow(p->pagetable, va);
+    return -1;
+  }
+
+  // sbrk()はp->szを動かすだけなので、ヒープのページはここで初めて割り当てる。
+  v = findvma(p, va);
+  if (v == 0 && va >= p->sz)
+    return -1;
+  if (v && ((v->prot & (PROT_READ | PROT_WRITE | PROT_EXEC)) == 0 ||
+            (write && (v->prot & PROT_WRITE) == 0)))
+    return -1;
+  if ((mem = kalloc_reclaim()) == 0)
+    return -1;
+  memset(mem, 0, PGSIZE);
+  perm = PTE_R | PTE_W | PTE_U;
+  if (v) {
+    // 書き込みのみや実行のみのPTEは使えないので、常にPTE_Rを付ける。
+    perm = PTE_R | PTE_U;
+    if (v->prot & PROT_WRITE)
+      perm |= PTE_W;
+    if (v->prot & PROT_EXEC)
+      perm |= PTE_X;
+    if (mmapload(v, va, mem) != 0) {
+      kfree(mem);
+      return -1;
+    }
+  } else if ((s = findseg(p, va)) != 0) {
+    perm = PTE_R | PTE_U | s->perm;
+    if (loadseg(p, s, va, mem) != 0) {
+      kfree(mem);
+      return -1;
+    }
+  }
+  if (mappages(p->pagetable, va, PGSIZE, (uint64)mem, perm) != 0) {
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// 現在のプロセスのユーザー仮想アドレス[va, va+len)のうち、
+// まだ用意されていないページを前もってフォルトさせる。
+// スピンロックやinodeのロックを保持したままcopyin()/copyout()を行う経路の前に、
+// ロックを取らずに呼び出す。
+// 失敗したページで打ち切り、vaから用意できたバイト数を返す。
+uint64
+uvmprefault(uint64 va, uint64 len, int write)
+{
+  struct proc *p = myproc();
+  uint64 a;
+  pte_t *pte;
+
+  for (a = PGROUNDDOWN(va); a < va + len; a += PGSIZE) {
+    if (a >= MAXVA)
+      break;
+    pte = walk(p->pagetable, a, 0);
+    if ((pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0 ||
+         (write && (*pte & PTE_W) == 0)) && uvmfault(p, a, write) != 0)
+      break;
+  }
+  if (a <= va)
+    return 0;
+  return a - va < len ? a - va : len;
+}
+
+// copyin()やcopyout()がマッピングのないユーザーページに触れたときに呼ばれる。
+// pagetableが現在のプロセスのものであれば、ページフォルトと同じように処理する。
+static int
+lazyfault(pagetable_t pagetable, uint64 va, int write)
+{
+  struct proc *p = myproc();
+
+  if (p == 0 || p->pagetable != pagetable)
+    return -1;
+  return uvmfault(p, va, write);
+}
+
 // PTEをユーザーアクセスに対して無効にする。
 // execでユーザースタックのガードページに使用される。
 void
@@ -346,9 +506,16 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
     if (va0 >= MAXVA)
       return -1;
     pte = walk(pagetable, va0, 0);
-    if (pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0 ||
-        (*pte & PTE_W) == 0)
+    if (pte == 0 || (*pte & PTE_V) == 0) {
+      if (lazyfault(pagetable, va0, 1) != 0)
+        return -1;
+      pte = walk(pagetable, va0, 0);
+    }
+    if ((*pte & PTE_U) == 0)
       return -1;
+    if ((*pte & PTE_W) == 0 && uvmcow(pagetable, va0) != 0)
+      return -1; // 読み取り専用ページ、またはコピーオンライトの複製に失敗した。
+    *pte |= PTE_D; // 物理アドレス経由の書き込みはハードウェアがPTE_Dを立てないため。
     pa0 = PTE2PA(*pte);
     n = PGSIZE - (dstva - va0);
     if (n > len)
@@ -373,7 +540,8 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
   while (len > 0) {
     va0 = PGROUNDDOWN(srcva);
     pa0 = walkaddr(pagetable, va0);
-    if (pa0 == 0)
+    if (pa0 == 0 && (lazyfault(pagetable, va0, 0) != 0 ||
+                     (pa0 = walkaddr(pagetable, va0)) == 0))
       return -1;
     n = PGSIZE - (srcva - va0);
     if (n > len)
@@ -399,7 +567,8 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
   while (got_null == 0 && max > 0) {
     va0 = PGROUNDDOWN(srcva);
     pa0 = walkaddr(pagetable, va0);
-    if (pa0 == 0)
+    if (pa0 == 0 && (lazyfault(pagetable, va0, 0) != 0 ||
+                     (pa0 = walkaddr(pagetable, va0)) == 0))
       return -1;
     n = PGSIZE - (srcva - va0);
     if (n > max)
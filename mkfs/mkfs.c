@@ -18,12 +18,15 @@
 #define NINODES 200
 
 // Disk layout:
-// [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
+// [ boot block | sb block | log | inode blocks | inode bit map | free bit map | data blocks ]
 
 int nbitmap = FSSIZE/(BSIZE*8) + 1;
 int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
-int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
+int ninodebitmap = NINODES/(BSIZE*8) + 1;
+int nlog = LOGBLOCKS;
+int nlogtrans;  // Max blocks per log transaction
+int maxop = MAXOPBLOCKS;
+int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, inode bitmap, bitmap)
 int nblocks;  // Number of data blocks
 
 int fsfd;
@@ -34,12 +37,14 @@ uint freeblock;
 
 
 void balloc(int);
+void iballoc(int);
 void wsect(uint, void*);
 void winode(uint, struct dinode*);
 void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+void dirlink(uint dino, char *name, uint inum);
 void die(const char *);
 
 // convert to riscv byte order
@@ -69,16 +74,36 @@ int
 main(int argc, char *argv[])
 {
   int i, cc, fd;
-  uint rootino, inum, off;
-  struct dirent de;
+  uint rootino, inum;
   char buf[BSIZE];
-  struct dinode din;
 
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
+  static_assert(sizeof(struct dirindex) == sizeof(struct dirent), "dirindex must fill one dirent slot");
+
+  // options choose the log geometry, which the kernel reads from the superblock
+  while(argc > 2 && argv[1][0] == '-'){
+    if(strcmp(argv[1], "-l") == 0)
+      nlog = atoi(argv[2]);
+    else if(strcmp(argv[1], "-o") == 0)
+      maxop = atoi(argv[2]);
+    else
+      break;
+    argc -= 2;
+    argv += 2;
+  }
 
-  if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+  if(argc < 2 || argv[1][0] == '-'){
+    fprintf(stderr, "Usage: mkfs [-l logblocks] [-o opblocks] fs.img files...\n");
+    exit(1);
+  }
+
+  // leave room for about three full transactions in the circular log
+  nlogtrans = (nlog - 1) / 3;
+  if(nlogtrans > LOGSIZE)
+    nlogtrans = LOGSIZE;
+  if(nlog > LOGBLOCKS || maxop < 1 || nlogtrans < maxop){
+    fprintf(stderr, "mkfs: need log blocks <= %d and op blocks <= log blocks/3\n", LOGBLOCKS);
     exit(1);
   }
 
@@ -90,7 +115,7 @@ main(int argc, char *argv[])
     die(argv[1]);
 
   // 1 fs block = 1 disk sector
-  nmeta = 2 + nlog + ninodeblocks + nbitmap;
+  nmeta = 2 + nlog + ninodeblocks + ninodebitmap + nbitmap;
   nblocks = FSSIZE - nmeta;
 
   sb.magic = FSMAGIC;
@@ -100,10 +125,16 @@ main(int argc, char *argv[])
   sb.nlog = xint(nlog);
   sb.logstart = xint(2);
   sb.inodestart = xint(2+nlog);
-  sb.bmapstart = xint(2+nlog+ninodeblocks);
+  sb.ibmapstart = xint(2+nlog+ninodeblocks);
+  sb.bmapstart = xint(2+nlog+ninodeblocks+ninodebitmap);
+  sb.nlogtrans = xint(nlogtrans);
+  sb.maxop = xint(maxop);
+  sb.bsize = xint(BSIZE);
 
-  printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
-         nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
+  printf("nmeta %d (boot, super, log blocks %u inode blocks %u, inode bitmap blocks %u, bitmap blocks %u) blocks %d total %d\n",
+         nmeta, nlog, ninodeblocks, ninodebitmap, nbitmap, nblocks, FSSIZE);
+  printf("block size %d, log transactions up to %d blocks, %d blocks reserved per op\n",
+         BSIZE, nlogtrans, maxop);
 
   freeblock = nmeta;     // the first free block that we can allocate
 
@@ -117,15 +148,8 @@ main(int argc, char *argv[])
   rootino = ialloc(T_DIR);
   assert(rootino == ROOTINO);
 
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, ".");
-  iappend(rootino, &de, sizeof(de));
-
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, "..");
-  iappend(rootino, &de, sizeof(de));
+  dirlink(rootino, ".", rootino);
+  dirlink(rootino, "..", rootino);
 
   for(i = 2; i < argc; i++){
     // get rid of "user/"
@@ -149,10 +173,7 @@ main(int argc, char *argv[])
 
     inum = ialloc(T_FILE);
 
-    bzero(&de, sizeof(de));
-    de.inum = xshort(inum);
-    strncpy(de.name, shortname, DIRSIZ);
-    iappend(rootino, &de, sizeof(de));
+    dirlink(rootino, shortname, inum);
 
     while((cc = read(fd, buf, sizeof(buf))) > 0)
       iappend(inum, buf, cc);
@@ -160,14 +181,8 @@ main(int argc, char *argv[])
     close(fd);
   }
 
-  // fix size of root inode dir
-  rinode(rootino, &din);
-  off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(rootino, &din);
-
   balloc(freeblock);
+  iballoc(freeinode);
 
   exit(0);
 }
@@ -247,8 +262,68 @@ balloc(int used)
   wsect(sb.bmapstart, buf);
 }
 
+// mark inodes 0 .. used-1 (inode 0 is never handed out) as allocated.
+void
+iballoc(int used)
+{
+  uchar buf[BSIZE];
+  int i;
+
+  printf("iballoc: first %d inodes have been allocated\n", used);
+  assert(used < BSIZE*8);
+  bzero(buf, BSIZE);
+  for(i = 0; i < used; i++){
+    buf[i/8] = buf[i/8] | (0x1 << (i%8));
+  }
+  printf("iballoc: write inode bitmap block at sector %d\n", IBBLOCK(0, sb));
+  wsect(IBBLOCK(0, sb), buf);
+}
+
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// return the sector holding file block fbn of din, allocating it
+// (and any indirect blocks on the way) if needed. the caller
+// writes din back.
+uint
+ibmap(struct dinode *din, uint fbn)
+{
+  uint indirect[NINDIRECT];
+  uint x, bn, span, level, i;
+
+  assert(fbn < MAXFILE);
+  if(fbn < NDIRECT){
+    if(xint(din->addrs[fbn]) == 0){
+      din->addrs[fbn] = xint(freeblock++);
+    }
+    return xint(din->addrs[fbn]);
+  }
+
+  // find how many levels of indirect blocks fbn needs, then
+  // walk down from the top one.
+  bn = fbn - NDIRECT;
+  span = NINDIRECT;
+  for(level = 1; bn >= span; level++){
+    bn -= span;
+    span *= NINDIRECT;
+  }
+  if(xint(din->addrs[NDIRECT+level-1]) == 0){
+    din->addrs[NDIRECT+level-1] = xint(freeblock++);
+  }
+  x = xint(din->addrs[NDIRECT+level-1]);
+  for(; level > 0; level--){
+    span /= NINDIRECT;
+    i = bn / span;
+    bn %= span;
+    rsect(x, (char*)indirect);
+    if(indirect[i] == 0){
+      indirect[i] = xint(freeblock++);
+      wsect(x, (char*)indirect);
+    }
+    x = xint(indirect[i]);
+  }
+  return x;
+}
+
 void
 iappend(uint inum, void *xp, int n)
 {
@@ -256,7 +331,6 @@ iappend(uint inum, void *xp, int n)
   uint fbn, off, n1;
   struct dinode din;
   char buf[BSIZE];
-  uint indirect[NINDIRECT];
   uint x;
 
   rinode(inum, &din);
@@ -264,23 +338,7 @@ iappend(uint inum, void *xp, int n)
   // printf("append inum %d at off %d sz %d\n", inum, off, n);
   while(n > 0){
     fbn = off / BSIZE;
-    assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
-      if(xint(din.addrs[fbn]) == 0){
-        din.addrs[fbn] = xint(freeblock++);
-      }
-      x = xint(din.addrs[fbn]);
-    } else {
-      if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
-      }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      }
-      x = xint(indirect[fbn-NDIRECT]);
-    }
+    x = ibmap(&din, fbn);
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
     bcopy(p, buf + off - (fbn * BSIZE), n1);
@@ -293,6 +351,90 @@ iappend(uint inum, void *xp, int n)
   winode(inum, &din);
 }
 
+// add (name, inum) to the hashed directory dino, splitting full
+// leaves the same way the kernel's dirlink() does.
+void
+dirlink(uint dino, char *name, uint inum)
+{
+  struct dinode din;
+  char hdr[BSIZE], leaf[BSIZE], nleaf[BSIZE];
+  struct dirent *de, *nde;
+  uint hsec, lsec, nsec, bn, nb, depth, size, ld, n, i;
+
+  rinode(dino, &din);
+  if(xint(din.size) == 0){
+    // a header block and the first leaf.
+    iappend(dino, zeroes, BSIZE);
+    iappend(dino, zeroes, BSIZE);
+    rinode(dino, &din);
+    hsec = ibmap(&din, 0);
+    rsect(hsec, hdr);
+    DIRLEAF(hdr, 0) = xint(1);
+    wsect(hsec, hdr);
+  }
+  hsec = ibmap(&din, 0);
+  rsect(hsec, hdr);
+
+  // "." and ".." live in the header.
+  if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0){
+    de = (struct dirent*)hdr + (name[1] == '.');
+    de->inum = xshort(inum);
+    strncpy(de->name, name, DIRSIZ);
+    wsect(hsec, hdr);
+    return;
+  }
+
+  for(;;){
+    depth = xshort(DIRDEPTH(hdr));
+    bn = xint(DIRLEAF(hdr, dirhash(name) & ((1 << depth) - 1)));
+    lsec = ibmap(&din, bn);
+    rsect(lsec, leaf);
+    for(de = (struct dirent*)leaf; de < (struct dirent*)(leaf + BSIZE); de++){
+      if(de->inum == 0){
+        de->inum = xshort(inum);
+        strncpy(de->name, name, DIRSIZ);
+        wsect(lsec, leaf);
+        return;
+      }
+    }
+
+    // the leaf is full: split it on the next hash bit, doubling
+    // the index if no bit is left.
+    size = 1 << depth;
+    n = 0;
+    for(i = 0; i < size; i++)
+      if(xint(DIRLEAF(hdr, i)) == bn)
+        n++;
+    for(ld = depth; n > 1; n >>= 1)
+      ld--;
+    if(ld == depth){
+      assert(size * 2 <= DIRNIDX);
+      for(i = 0; i < size; i++)
+        DIRLEAF(hdr, size + i) = DIRLEAF(hdr, i);
+      DIRDEPTH(hdr) = xshort(++depth);
+      size *= 2;
+    }
+    nb = xint(din.size) / BSIZE;
+    iappend(dino, zeroes, BSIZE);
+    rinode(dino, &din);
+    nsec = ibmap(&din, nb);
+    for(i = 0; i < size; i++)
+      if(xint(DIRLEAF(hdr, i)) == bn && (i >> ld) & 1)
+        DIRLEAF(hdr, i) = xint(nb);
+    bzero(nleaf, BSIZE);
+    nde = (struct dirent*)nleaf;
+    for(de = (struct dirent*)leaf; de < (struct dirent*)(leaf + BSIZE); de++){
+      if(de->inum && (dirhash(de->name) >> ld) & 1){
+        *nde++ = *de;
+        bzero(de, sizeof(*de));
+      }
+    }
+    wsect(hsec, hdr);
+    wsect(lsec, leaf);
+    wsect(nsec, nleaf);
+  }
+}
+
 void
 die(const char *s)
 {
@@ -0,0 +1,132 @@
+// バッファキャッシュの競合を測るベンチマークである。
+// 子プロセスごとに別のディレクトリとファイルを用意し、それぞれが自分のファイルを
+// 繰り返し読む。ブロックはすべてキャッシュに載っているので、bread()はヒットし続ける。
+// 子プロセスの数を1から増やしていき、全体の読み込み回数あたりの時間を表示する。
+// バッファキャッシュのロックが競合しなければ、CPU数までは処理量が子プロセスの数に比例して伸びる。
+//
+// 使い方: bcachetest [最大の子プロセス数]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+#include "kernel/fs.h"
+#include "kernel/fcntl.h"
+
+#define NBLK    4     // 子プロセスごとのファイルのブロック数
+#define ROUNDS  2000  // 子プロセスごとにファイル全体を読む回数
+#define MAXPROC 8
+
+char buf[BSIZE];
+
+// 子プロセスiのディレクトリ名を作る。
+static void
+dirname(char *path, int i)
+{
+  strcpy(path, "bcache0");
+  path[6] += i;
+}
+
+// 子プロセスiのファイルを作る。
+static void
+setup(int i)
+{
+  char path[16];
+  int fd, b;
+
+  dirname(path, i);
+  mkdir(path);
+  if(chdir(path) < 0){
+    printf("bcachetest: chdir %s failed\n", path);
+    exit(1);
+  }
+  if((fd = open("f", O_CREATE | O_RDWR)) < 0){
+    printf("bcachetest: create failed\n");
+    exit(1);
+  }
+  memset(buf, 'a' + i, sizeof(buf));
+  for(b = 0; b < NBLK; b++){
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("bcachetest: write failed\n");
+      exit(1);
+    }
+  }
+  close(fd);
+  chdir("..");
+}
+
+// 子プロセスiとして自分のファイルを繰り返し読む。
+// パス名の検索でルートディレクトリのブロックを共有しないように、先に自分のディレクトリに移る。
+static void
+reader(int i)
+{
+  char path[16];
+  int fd, r, b;
+
+  dirname(path, i);
+  if(chdir(path) < 0)
+    exit(1);
+  for(r = 0; r < ROUNDS; r++){
+    if((fd = open("f", O_RDONLY)) < 0)
+      exit(1);
+    for(b = 0; b < NBLK; b++)
+      if(read(fd, buf, sizeof(buf)) != sizeof(buf))
+        exit(1);
+    close(fd);
+  }
+  exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int maxproc = 4, nproc, i, xstatus, t0, t1;
+  struct bcachestat st0, st1;
+
+  if(argc > 1)
+    maxproc = atoi(argv[1]);
+  if(maxproc < 1 || maxproc > MAXPROC){
+    printf("usage: bcachetest [1-%d]\n", MAXPROC);
+    exit(1);
+  }
+
+  for(i = 0; i < maxproc; i++)
+    setup(i);
+
+  for(nproc = 1; nproc <= maxproc; nproc++){
+    bcachestat(&st0);
+    t0 = uptime();
+    for(i = 0; i < nproc; i++){
+      int pid = fork();
+      if(pid < 0){
+        printf("bcachetest: fork failed\n");
+        exit(1);
+      }
+      if(pid == 0)
+        reader(i);
+    }
+    for(i = 0; i < nproc; i++){
+      wait(&xstatus);
+      if(xstatus != 0){
+        printf("bcachetest: reader failed\n");
+        exit(1);
+      }
+    }
+    t1 = uptime();
+    bcachestat(&st1);
+    printf("bcachetest: %d procs: %d file reads in %d ticks (hits %d, misses %d)\n",
+           nproc, nproc * ROUNDS * NBLK, t1 - t0,
+           (int)(st1.hits - st0.hits), (int)(st1.misses - st0.misses));
+  }
+  printf("bcachetest: %d of %d buffers, %d evictions\n",
+         st1.nbuf, st1.maxbuf, (int)st1.evictions);
+
+  for(i = 0; i < maxproc; i++){
+    char path[16];
+    dirname(path, i);
+    chdir(path);
+    unlink("f");
+    chdir("..");
+    unlink(path);
+  }
+  exit(0);
+}
@@ -0,0 +1,114 @@
+// ディスクの遅延を測るベンチマークである。
+// ファイルを用意してから、割り込みモードとポーリングモードのそれぞれで
+// バッファキャッシュを空にし、ファイルをmmap()してページをランダムな順に読む。
+// ページフォルトごとに4KiBの読み込みが1回起きる。
+// 同期I/Oの発行から完了までの時間のヒストグラムをモードごとに表示する。
+// qemuのタイマーは10MHzで動くので、1サイクルは0.1マイクロ秒である。
+//
+// 使い方: disklat [ポーリングするサイクル数]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+#include "kernel/fs.h"
+#include "kernel/fcntl.h"
+
+#define CHUNK  4096   // 1回に読むバイト数（1ページ）
+#define POLL   100000 // 既定のポーリングするサイクル数（10ミリ秒）
+#define NCHUNK 64     // ファイルのページ数
+
+char buf[CHUNK];
+int order[NCHUNK];
+unsigned long seed = 1;
+
+static unsigned int
+rand(void)
+{
+  seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+  return seed >> 33;
+}
+
+// fdのファイルのnchunkページをランダムな順に1回ずつ読み、遅延のヒストグラムを表示する。
+static void
+run(char *mode, int fd, int nchunk)
+{
+  struct diskstat st0, st1;
+  uint64 *h0, *h1;
+  char *p;
+  int i, j, n, t0, sum = 0;
+
+  for(i = 0; i < nchunk; i++)
+    order[i] = i;
+  for(i = nchunk - 1; i > 0; i--){
+    j = rand() % (i + 1);
+    n = order[i];
+    order[i] = order[j];
+    order[j] = n;
+  }
+
+  if((p = mmap(0, nchunk * CHUNK, PROT_READ, MAP_PRIVATE, fd, 0)) == (char*)-1){
+    printf("disklat: mmap failed\n");
+    exit(1);
+  }
+  diskctl(DISK_DROP, 0);
+  diskstat(&st0);
+  t0 = uptime();
+  for(i = 0; i < nchunk; i++)
+    sum += p[order[i] * CHUNK];
+  n = uptime() - t0;
+  diskstat(&st1);
+  munmap(p, nchunk * CHUNK);
+
+  printf("disklat: %s: %d reads in %d ticks, %d polled, %d fell back to interrupts (sum %d)\n",
+         mode, nchunk, n, (int)(st1.polled - st0.polled), (int)(st1.pollmiss - st0.pollmiss),
+         sum);
+  if(st1.poll){
+    h0 = st0.pollhist;
+    h1 = st1.pollhist;
+  } else {
+    h0 = st0.intrhist;
+    h1 = st1.intrhist;
+  }
+  for(i = 0; i < NDISKLAT; i++){
+    n = h1[i] - h0[i];
+    if(n > 0)
+      printf("disklat:   %d-%d cycles: %d\n", 1 << i, (2 << i) - 1, n);
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  int poll = POLL, fd, i, nchunk, old;
+
+  if(argc > 1)
+    poll = atoi(argv[1]);
+  if(poll <= 0){
+    printf("usage: disklat [poll cycles]\n");
+    exit(1);
+  }
+
+  nchunk = NCHUNK;
+  unlink("disklat.tmp");
+  if((fd = open("disklat.tmp", O_CREATE | O_RDWR)) < 0){
+    printf("disklat: create failed\n");
+    exit(1);
+  }
+  for(i = 0; i < nchunk; i++){
+    memset(buf, i, sizeof(buf));
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("disklat: write failed\n");
+      exit(1);
+    }
+  }
+
+  old = diskctl(DISK_POLL, 0);
+  run("interrupt", fd, nchunk);
+  diskctl(DISK_POLL, poll);
+  run("polling", fd, nchunk);
+  diskctl(DISK_POLL, old);
+
+  close(fd);
+  unlink("disklat.tmp");
+  exit(0);
+}
@@ -1,4 +1,6 @@
 struct stat;
+struct bcachestat;
+struct diskstat;
 
 // system calls
 int fork(void);
@@ -22,6 +24,12 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+void* mmap(void*, uint, int, int, int, int);
+int munmap(void*, uint);
+int bcachestat(struct bcachestat*);
+int diskstat(struct diskstat*);
+int diskctl(int, int);
+int fsync(int);
 
 // ulib.c
 int stat(const char*, struct stat*);
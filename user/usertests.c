@@ -578,6 +578,10 @@ writetest(char *s)
   }
 }
 
+// write a file that needs the double-indirect block, but not so large
+// that it fills the disk now that MAXFILE is much bigger.
+#define BIGFILE (NDIRECT + NINDIRECT + 64)
+
 void
 writebig(char *s)
 {
@@ -589,7 +593,7 @@ writebig(char *s)
     exit(1);
   }
 
-  for(i = 0; i < MAXFILE; i++){
+  for(i = 0; i < BIGFILE; i++){
     ((int*)buf)[0] = i;
     if(write(fd, buf, BSIZE) != BSIZE){
       printf("%s: error: write big file failed i=%d\n", s, i);
@@ -609,7 +613,7 @@ writebig(char *s)
   for(;;){
     i = read(fd, buf, BSIZE);
     if(i == 0){
-      if(n == MAXFILE - 1){
+      if(n != BIGFILE){
         printf("%s: read only %d blocks from big", s, n);
         exit(1);
       }
@@ -1996,6 +2000,877 @@ forktest(char *s)
   }
 }
 
+// sbrk() only reserves address space; pages are allocated when
+// first touched, by a page fault or by a system call that copies
+// to or from them.  a reservation much bigger than physical memory
+// should work as long as only a few of its pages are used.
+void
+lazysbrk(char *s)
+{
+  enum { BIG=1024*1024*1024 };
+  char *a, *mid, *last;
+  int fds[2], pid, xstatus;
+
+  a = sbrk(BIG);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk(%d) failed\n", s, BIG);
+    exit(1);
+  }
+  mid = a + BIG/2;
+  last = a + BIG - 1;
+  if(*mid != 0 || *last != 0){
+    printf("%s: lazy page not zero\n", s);
+    exit(1);
+  }
+  *last = 'y';
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  // write() from a page that has never been touched.
+  if(write(fds[1], a + BIG/4, 1) != 1){
+    printf("%s: write from lazy page failed\n", s);
+    exit(1);
+  }
+  // read() into a page that has never been touched.
+  if(read(fds[0], a + 3*(BIG/4), 1) != 1 || a[3*(BIG/4)] != 0){
+    printf("%s: read into lazy page failed\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(*last != 'y' || a[BIG/8] != 0)
+      exit(1);
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child saw wrong memory\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+
+  if(sbrk(-BIG) != a + BIG){
+    printf("%s: sbrk shrink failed\n", s);
+    exit(1);
+  }
+}
+
+// initialized data that no test touches until lazyexec(), so that
+// its pages are still unloaded when exec'd usertests reaches it.
+char lazyexecdata[3*4096] = { 'x', [4096] = 'y', [2*4096] = 'z' };
+
+// exec loads program pages on demand. check that never-touched
+// data pages read correctly from user code, from the kernel via
+// write(), and from a forked child, and that writes into them
+// through read() (copyout) work.
+void
+lazyexec(char *s)
+{
+  int fds[2], pid, xstatus;
+  char buf[2];
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  // write() from a data page that has not been loaded yet.
+  if(write(fds[1], &lazyexecdata[4096], 1) != 1){
+    printf("%s: write from unloaded page failed\n", s);
+    exit(1);
+  }
+  if(read(fds[0], buf, 1) != 1 || buf[0] != 'y'){
+    printf("%s: wrong data from unloaded page\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(lazyexecdata[2*4096] != 'z')
+      exit(1);
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child saw wrong data\n", s);
+    exit(1);
+  }
+
+  // read() into a data page, replacing its file contents.
+  if(write(fds[1], "w", 1) != 1 || read(fds[0], &lazyexecdata[0], 1) != 1){
+    printf("%s: read into data page failed\n", s);
+    exit(1);
+  }
+  if(lazyexecdata[0] != 'w' || lazyexecdata[1] != 0){
+    printf("%s: wrong data after read\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// a program being executed can't be opened for writing or
+// truncated, and a program open for writing can't be executed,
+// since exec loads its pages from the file on demand.
+void
+txtbusy(char *s)
+{
+  int fd, pid, xstatus;
+
+  if(open("usertests", O_WRONLY) >= 0 || open("usertests", O_RDWR) >= 0 ||
+     open("usertests", O_RDONLY|O_TRUNC) >= 0){
+    printf("%s: opened running program for writing\n", s);
+    exit(1);
+  }
+
+  fd = open("echo", O_RDWR);
+  if(fd < 0){
+    printf("%s: open echo failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    char *argv[] = { "echo", "txtbusy", 0 };
+    exec("echo", argv);
+    exit(7);
+  }
+  wait(&xstatus);
+  close(fd);
+  if(xstatus != 7){
+    printf("%s: exec of a program open for writing\n", s);
+    exit(1);
+  }
+}
+
+// map a file privately and shared, write through the shared
+// mapping and check that munmap() wrote it back, unmap part of
+// a mapping, and check that fork() inherits shared anonymous and
+// private mappings with the right sharing.
+void
+mmaptest(char *s)
+{
+  enum { SZ = 2*4096 + 100 };
+  char *file = "mmaptest.tmp";
+  char buf[100];
+  char *p, *q;
+  int fd, i, pid, xstatus;
+
+  fd = open(file, O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: open %s failed\n", s, file);
+    exit(1);
+  }
+  for(i = 0; i < SZ; i++){
+    buf[0] = 'a' + i % 26;
+    if(write(fd, buf, 1) != 1){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+
+  p = mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(p == (char*)-1){
+    printf("%s: mmap private failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < SZ; i++){
+    if(p[i] != 'a' + i % 26){
+      printf("%s: wrong data at %d\n", s, i);
+      exit(1);
+    }
+  }
+  if(p[SZ] != 0){
+    printf("%s: page past end of file not zero\n", s);
+    exit(1);
+  }
+  p[0] = 'X';
+  if(munmap(p, SZ) < 0){
+    printf("%s: munmap private failed\n", s);
+    exit(1);
+  }
+
+  p = mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == (char*)-1){
+    printf("%s: mmap shared failed\n", s);
+    exit(1);
+  }
+  p[1] = 'Y';
+  p[4096 + 1] = 'Z';
+  // unmapping the first page writes it back and leaves the rest mapped.
+  if(munmap(p, 4096) < 0 || p[4096 + 1] != 'Z' || munmap(p + 4096, SZ - 4096) < 0){
+    printf("%s: partial munmap failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open(file, O_RDONLY);
+  if(fd < 0 || read(fd, buf, 2) != 2 || buf[0] != 'a' || buf[1] != 'Y'){
+    printf("%s: shared write not in file\n", s);
+    exit(1);
+  }
+  p = mmap(0, SZ, PROT_READ, MAP_SHARED, fd, 0);
+  if(p == (char*)-1 || p[4096 + 1] != 'Z'){
+    printf("%s: second shared write not in file\n", s);
+    exit(1);
+  }
+  close(fd);
+  // the mapping holds its own reference to the file.
+  if(p[2] != 'c' || munmap(p, SZ) < 0){
+    printf("%s: mapping lost after close\n", s);
+    exit(1);
+  }
+  unlink(file);
+
+  p = mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  q = mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(p == (char*)-1 || q == (char*)-1 || p[0] != 0 || q[0] != 0){
+    printf("%s: anonymous mmap failed\n", s);
+    exit(1);
+  }
+  q[0] = 'q';
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(q[0] != 'q')
+      exit(1);
+    p[0] = 'p';
+    q[0] = 'c';
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0 || p[0] != 'p' || q[0] != 'q'){
+    printf("%s: wrong sharing after fork\n", s);
+    exit(1);
+  }
+  if(munmap(p, 4096) < 0 || munmap(q, 4096) < 0){
+    printf("%s: munmap anonymous failed\n", s);
+    exit(1);
+  }
+}
+
+// the buffer cache grows beyond its initial size, so a file
+// much larger than NBUFMIN blocks stays cached between reads.
+void
+bcachegrow(char *s)
+{
+  enum { NBLOCKS = 200 };
+  char *file = "bcachegrow.tmp";
+  struct bcachestat st0, st1;
+  int fd, i, pass;
+
+  fd = open(file, O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: open %s failed\n", s, file);
+    exit(1);
+  }
+  memset(buf, 'b', BSIZE);
+  for(i = 0; i < NBLOCKS; i++){
+    if(write(fd, buf, BSIZE) != BSIZE){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  for(pass = 0; pass < 2; pass++){
+    if(bcachestat(&st0) < 0){
+      printf("%s: bcachestat failed\n", s);
+      exit(1);
+    }
+    fd = open(file, O_RDONLY);
+    for(i = 0; i < NBLOCKS; i++){
+      if(read(fd, buf, BSIZE) != BSIZE || buf[0] != 'b'){
+        printf("%s: read failed\n", s);
+        exit(1);
+      }
+    }
+    close(fd);
+    bcachestat(&st1);
+  }
+  // the second pass must be served entirely from memory.
+  if(st1.misses != st0.misses || st1.nbuf <= NBLOCKS){
+    printf("%s: %d misses on reread, %d buffers\n", s,
+           (int)(st1.misses - st0.misses), st1.nbuf);
+    exit(1);
+  }
+  unlink(file);
+}
+
+static void
+hdname(char *name, int i)
+{
+  strcpy(name, "hd/e0000");
+  name[4] += i / 1000;
+  name[5] += (i / 100) % 10;
+  name[6] += (i / 10) % 10;
+  name[7] += i % 10;
+}
+
+// fill a directory until its hashed index splits leaves several
+// times, then check that lookups, unlinks, a sequential read of
+// the directory, and removing it all still agree.
+// N is five leaves' worth of entries at any block size.
+void
+hashdir(char *s)
+{
+  enum { N = 5 * (BSIZE / sizeof(struct dirent)) };
+  int i, fd, n;
+  char name[16];
+  struct dirent de;
+
+  unlink("hdf");
+  if(mkdir("hd") < 0){
+    printf("%s: mkdir hd failed\n", s);
+    exit(1);
+  }
+  fd = open("hdf", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create hdf failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  for(i = 0; i < N; i++){
+    hdname(name, i);
+    if(link("hdf", name) != 0){
+      printf("%s: link %s failed\n", s, name);
+      exit(1);
+    }
+  }
+  for(i = 0; i < N; i += 2){
+    hdname(name, i);
+    if(unlink(name) != 0){
+      printf("%s: unlink %s failed\n", s, name);
+      exit(1);
+    }
+  }
+  for(i = 0; i < N; i++){
+    hdname(name, i);
+    fd = open(name, O_RDONLY);
+    if((i % 2 == 0) != (fd < 0)){
+      printf("%s: open %s gave %d\n", s, name, fd);
+      exit(1);
+    }
+    if(fd >= 0)
+      close(fd);
+  }
+
+  // the index is invisible to a sequential reader.
+  fd = open("hd", O_RDONLY);
+  n = 0;
+  while(read(fd, &de, sizeof(de)) == sizeof(de))
+    if(de.inum != 0)
+      n++;
+  close(fd);
+  if(n != N / 2 + 2){
+    printf("%s: read %d entries, expected %d\n", s, n, N / 2 + 2);
+    exit(1);
+  }
+
+  if(unlink("hd") == 0){
+    printf("%s: unlinked a non-empty directory\n", s);
+    exit(1);
+  }
+  for(i = 1; i < N; i += 2){
+    hdname(name, i);
+    unlink(name);
+  }
+  if(unlink("hd") != 0){
+    printf("%s: unlink hd failed\n", s);
+    exit(1);
+  }
+  unlink("hdf");
+}
+
+// path lookups go through the kernel's directory entry cache,
+// including cached misses; creating, unlinking and removing
+// directories (whose inode numbers get reused) must keep it right.
+void
+dcache(char *s)
+{
+  int fd, i;
+
+  unlink("dcf");
+  for(i = 0; i < 3; i++){
+    if(open("dcf", O_RDONLY) >= 0){
+      printf("%s: opened dcf before creating it\n", s);
+      exit(1);
+    }
+    fd = open("dcf", O_CREATE|O_RDWR);
+    if(fd < 0){
+      printf("%s: create dcf failed\n", s);
+      exit(1);
+    }
+    close(fd);
+    if((fd = open("dcf", O_RDONLY)) < 0){
+      printf("%s: open dcf failed\n", s);
+      exit(1);
+    }
+    close(fd);
+    if(unlink("dcf") != 0){
+      printf("%s: unlink dcf failed\n", s);
+      exit(1);
+    }
+  }
+
+  // look up ".." in a directory, remove it, and make another
+  // directory elsewhere that may reuse its inode number.
+  if(mkdir("dca") < 0 || mkdir("dca/x") < 0 || mkdir("dcb") < 0){
+    printf("%s: mkdir failed\n", s);
+    exit(1);
+  }
+  if((fd = open("dca/x/../x/..", O_RDONLY)) < 0){
+    printf("%s: open dca/x/../x/.. failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(unlink("dca/x") != 0){
+    printf("%s: unlink dca/x failed\n", s);
+    exit(1);
+  }
+  if(mkdir("dcb/y") < 0 || (fd = open("dcb/m", O_CREATE|O_RDWR)) < 0){
+    printf("%s: dcb failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if((fd = open("dcb/y/../m", O_RDONLY)) < 0){
+    printf("%s: .. of dcb/y is stale\n", s);
+    exit(1);
+  }
+  close(fd);
+  if((fd = open("dca/x/..", O_RDONLY)) >= 0){
+    printf("%s: removed dca/x still found\n", s);
+    exit(1);
+  }
+  unlink("dcb/m");
+  unlink("dcb/y");
+  unlink("dcb");
+  unlink("dca");
+}
+
+// several processes hold many distinct files open at once, more
+// than the old fixed inode table of 50 entries could hold.
+void
+manyinodes(char *s)
+{
+  enum { NCHILD=6, NF=12 };
+  int ready[2], done[2], pid, i, j, fd, xstatus;
+  char name[8], c;
+
+  if(pipe(ready) < 0 || pipe(done) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < NCHILD; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      close(ready[0]);
+      close(done[1]);
+      for(j = 0; j < NF; j++){
+        name[0] = 'm';
+        name[1] = 'i';
+        name[2] = 'a' + i;
+        name[3] = 'a' + j;
+        name[4] = '\0';
+        if((fd = open(name, O_CREATE|O_RDWR)) < 0){
+          printf("%s: open %s failed\n", s, name);
+          exit(1);
+        }
+      }
+      write(ready[1], "x", 1);
+      close(ready[1]);
+      read(done[0], &c, 1); // wait until every child holds its files.
+      exit(0);
+    }
+  }
+  close(ready[1]);
+  close(done[0]);
+  for(i = 0; i < NCHILD; i++){
+    if(read(ready[0], &c, 1) != 1){
+      printf("%s: child failed\n", s);
+      exit(1);
+    }
+  }
+  close(done[1]);
+  close(ready[0]);
+  for(i = 0; i < NCHILD; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+  }
+  for(i = 0; i < NCHILD; i++){
+    for(j = 0; j < NF; j++){
+      name[0] = 'm';
+      name[1] = 'i';
+      name[2] = 'a' + i;
+      name[3] = 'a' + j;
+      name[4] = '\0';
+      unlink(name);
+    }
+  }
+}
+
+static void
+ibname(char *name, int i)
+{
+  strcpy(name, "ibd/f000");
+  name[5] += i / 100;
+  name[6] += (i / 10) % 10;
+  name[7] += i % 10;
+}
+
+// create files in a new directory, crossing a byte of the inode
+// bitmap, and check that they are allocated after the directory's
+// inode; unlink and re-create them and check that the same inodes
+// come back; then run out of inodes and check that create fails
+// cleanly and works again once files are removed.
+void
+ibitmap(char *s)
+{
+  enum { NF=20, MAX=1000 };
+  int i, n, fd;
+  uint dino, ino[NF];
+  char name[16];
+  struct stat st;
+
+  if(mkdir("ibd") < 0 || (fd = open("ibd", O_RDONLY)) < 0){
+    printf("%s: mkdir ibd failed\n", s);
+    exit(1);
+  }
+  fstat(fd, &st);
+  close(fd);
+  dino = st.ino;
+
+  for(i = 0; i < NF; i++){
+    ibname(name, i);
+    if((fd = open(name, O_CREATE|O_RDWR)) < 0){
+      printf("%s: create %s failed\n", s, name);
+      exit(1);
+    }
+    fstat(fd, &st);
+    close(fd);
+    ino[i] = st.ino;
+    if(ino[i] <= (i == 0 ? dino : ino[i-1])){
+      printf("%s: %s got inode %d, not after %d\n", s, name, ino[i],
+             i == 0 ? dino : ino[i-1]);
+      exit(1);
+    }
+  }
+
+  for(i = 0; i < NF; i++){
+    ibname(name, i);
+    if(unlink(name) < 0){
+      printf("%s: unlink %s failed\n", s, name);
+      exit(1);
+    }
+  }
+  for(i = 0; i < NF; i++){
+    ibname(name, i);
+    if((fd = open(name, O_CREATE|O_RDWR)) < 0){
+      printf("%s: re-create %s failed\n", s, name);
+      exit(1);
+    }
+    fstat(fd, &st);
+    close(fd);
+    if(st.ino != ino[i]){
+      printf("%s: %s got inode %d, expected freed inode %d\n", s, name,
+             st.ino, ino[i]);
+      exit(1);
+    }
+  }
+
+  // use up the remaining inodes.
+  for(n = NF; n < MAX; n++){
+    ibname(name, n);
+    if((fd = open(name, O_CREATE|O_RDWR)) < 0)
+      break;
+    close(fd);
+  }
+  if(n == MAX){
+    printf("%s: created %d files without running out of inodes\n", s, MAX);
+    exit(1);
+  }
+  ibname(name, n - 1);
+  if(unlink(name) < 0 || (fd = open(name, O_CREATE|O_RDWR)) < 0){
+    printf("%s: create after running out of inodes failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  for(i = 0; i < n; i++){
+    ibname(name, i);
+    if(unlink(name) < 0){
+      printf("%s: unlink %s failed\n", s, name);
+      exit(1);
+    }
+  }
+  if(unlink("ibd") < 0){
+    printf("%s: unlink ibd failed\n", s);
+    exit(1);
+  }
+}
+
+// several processes write files concurrently, so their operations
+// join transactions that commit while others are still being
+// written; each fsync()s and the parent checks every file.
+void
+groupcommit(char *s)
+{
+  enum { N=10, NCHILD=4, SZ=500 };
+  int fd, pid, i, j, n, pi, xstatus;
+  char name[8];
+
+  if(fsync(-1) != -1){
+    printf("%s: fsync of a bad fd succeeded\n", s);
+    exit(1);
+  }
+
+  for(pi = 0; pi < NCHILD; pi++){
+    name[0] = 'g';
+    name[1] = 'c';
+    name[2] = '0' + pi;
+    name[3] = '\0';
+    unlink(name);
+
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      fd = open(name, O_CREATE | O_RDWR);
+      if(fd < 0){
+        printf("%s: create failed\n", s);
+        exit(1);
+      }
+      memset(buf, 'a'+pi, SZ);
+      for(i = 0; i < N; i++){
+        if(write(fd, buf, SZ) != SZ){
+          printf("%s: write failed\n", s);
+          exit(1);
+        }
+        if(i % 3 == 0 && fsync(fd) != 0){
+          printf("%s: fsync failed\n", s);
+          exit(1);
+        }
+      }
+      if(fsync(fd) != 0){
+        printf("%s: fsync failed\n", s);
+        exit(1);
+      }
+      close(fd);
+      exit(0);
+    }
+  }
+
+  for(pi = 0; pi < NCHILD; pi++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(xstatus);
+  }
+
+  for(pi = 0; pi < NCHILD; pi++){
+    name[2] = '0' + pi;
+    fd = open(name, O_RDONLY);
+    if(fd < 0){
+      printf("%s: open %s failed\n", s, name);
+      exit(1);
+    }
+    n = 0;
+    while((i = read(fd, buf, SZ)) > 0){
+      for(j = 0; j < i; j++){
+        if(buf[j] != 'a'+pi){
+          printf("%s: wrong char\n", s);
+          exit(1);
+        }
+      }
+      n += i;
+    }
+    close(fd);
+    if(n != N*SZ){
+      printf("%s: wrong length %d\n", s, n);
+      exit(1);
+    }
+    unlink(name);
+  }
+}
+
+// many small metadata transactions wrap around the circular log
+// several times; blocks rewritten by many transactions (the directory
+// and inode blocks) must end up with their last contents.
+void
+logwrap(char *s)
+{
+  enum { N=200 };
+  char name[8];
+  int i, fd;
+
+  for(i = 0; i < N; i++){
+    name[0] = 'l';
+    name[1] = 'w';
+    name[2] = '0' + i % 10;
+    name[3] = '\0';
+    if(mkdir(name) != 0){
+      printf("%s: mkdir %s failed\n", s, name);
+      exit(1);
+    }
+    if(i % 10 == 9){
+      for(int j = 0; j < 10; j++){
+        name[2] = '0' + j;
+        if(unlink(name) != 0){
+          printf("%s: unlink %s failed\n", s, name);
+          exit(1);
+        }
+      }
+    }
+  }
+  for(i = 0; i < 10; i++){
+    name[2] = '0' + i;
+    if((fd = open(name, O_RDONLY)) >= 0){
+      printf("%s: %s still exists\n", s, name);
+      exit(1);
+    }
+  }
+}
+
+// fork a process that uses two thirds of physical memory.
+// this only works if fork shares pages copy-on-write.
+// the child then writes to some of the shared pages, both
+// directly and through read() (copyout), and the parent
+// checks that its own copy did not change.
+void
+cowfork(char *s)
+{
+  uint64 phys_size = PHYSTOP - KERNBASE;
+  int sz = (phys_size / 3) * 2;
+  int pid, xstatus, fds[2];
+  char *p, *q;
+
+  p = sbrk(sz);
+  if(p == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk(%d) failed\n", s, sz);
+    exit(1);
+  }
+  for(q = p; q < p + sz; q += 4096)
+    *(int*)q = getpid();
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if(write(fds[1], "x", 1) != 1){
+    printf("%s: pipe write failed\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(q = p; q < p + sz; q += 64*4096)
+      *(int*)q = 0;
+    if(read(fds[0], p + 4096 + 4, 1) != 1 || p[4096+4] != 'x'){
+      printf("%s: read into cow page failed\n", s);
+      exit(1);
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(1);
+
+  for(q = p; q < p + sz; q += 4096){
+    if(*(int*)q != getpid()){
+      printf("%s: parent memory changed by child\n", s);
+      exit(1);
+    }
+  }
+  if(p[4096+4] == 'x'){
+    printf("%s: parent memory changed by child read\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  sbrk(-sz);
+}
+
+// several processes fork and grow and shrink their memory at the
+// same time, so that pages move between the per-CPU free lists
+// in kalloc.c.
+void
+forksbrkpar(char *s)
+{
+  enum { NCHILD = 4, ROUNDS = 20, SZ = 32*4096 };
+  int i, j, pid, xstatus;
+  char *a, *p;
+
+  for(i = 0; i < NCHILD; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      for(j = 0; j < ROUNDS; j++){
+        a = sbrk(SZ);
+        if(a == (char*)0xffffffffffffffffL){
+          printf("%s: sbrk failed\n", s);
+          exit(1);
+        }
+        for(p = a; p < a + SZ; p += 4096)
+          *p = j;
+        pid = fork();
+        if(pid < 0){
+          printf("%s: fork failed\n", s);
+          exit(1);
+        }
+        if(pid == 0)
+          exit(a[SZ-4096] == j ? 0 : 1);
+        wait(&xstatus);
+        if(xstatus != 0){
+          printf("%s: child saw wrong memory\n", s);
+          exit(1);
+        }
+        if(sbrk(-SZ) == (char*)0xffffffffffffffffL){
+          printf("%s: sbrk shrink failed\n", s);
+          exit(1);
+        }
+      }
+      exit(0);
+    }
+  }
+
+  for(i = 0; i < NCHILD; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+  }
+}
+
 void
 sbrkbasic(char *s)
 {
@@ -2628,6 +3503,19 @@ struct test {
   {dirfile, "dirfile"},
   {iref, "iref"},
   {forktest, "forktest"},
+  {forksbrkpar, "forksbrkpar"},
+  {cowfork, "cowfork"},
+  {lazysbrk, "lazysbrk"},
+  {lazyexec, "lazyexec"},
+  {txtbusy, "txtbusy"},
+  {mmaptest, "mmaptest"},
+  {bcachegrow, "bcachegrow"},
+  {groupcommit, "groupcommit"},
+  {logwrap, "logwrap"},
+  {manyinodes, "manyinodes"},
+  {ibitmap, "ibitmap"},
+  {hashdir, "hashdir"},
+  {dcache, "dcache"},
   {sbrkbasic, "sbrkbasic"},
   {sbrkmuch, "sbrkmuch"},
   {kernmem, "kernmem"},
@@ -2847,7 +3735,7 @@ diskfull(char *s)
       break;
     }
     for(int i = 0; i < MAXFILE; i++){
-      char buf[BSIZE];
+      // buf is global: a BSIZE array would not fit on the one-page user stack.
       if(write(fd, buf, BSIZE) != BSIZE){
         done = 1;
         close(fd);
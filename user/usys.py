@@ -26,6 +26,12 @@ syscalls = [
     "sbrk",
     "sleep",
     "uptime",
+    "mmap",
+    "munmap",
+    "bcachestat",
+    "diskstat",
+    "diskctl",
+    "fsync",
 ]
 
 # ヘッダーを出力